@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+"""Run the Lox benchmark programs and report median wall time and peak RSS.
+
+Every *.lox file next to this script is one benchmark. Each one is run once as a
+warm-up (which also writes its .loxc bytecode cache) and then --runs more times.
+The programs are copied into a scratch directory first, so the caches never end up
+in the source tree.
+
+Usage: run.py --bcvm PATH [--runs N] [--format json|csv] [--output FILE] [NAME ...]
+"""
+
+import argparse
+import csv
+import io
+import json
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+BENCHMARK_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+def rusage_peak_kb(rusage):
+    # ru_maxrss is in kilobytes on Linux and in bytes on macOS.
+    if sys.platform == "darwin":
+        return rusage.ru_maxrss // 1024
+    return rusage.ru_maxrss
+
+
+class HighWaterMark(threading.Thread):
+    """Track VmHWM of a running process on Linux.
+
+    ru_maxrss of a child also counts the pages it inherited from this Python process before
+    exec, which would hide the interpreter's own footprint. VmHWM belongs to the exec'd image
+    only, so it is sampled from /proc until the process goes away."""
+
+    def __init__(self, pid):
+        super().__init__(daemon=True)
+        self.path = "/proc/%d/status" % pid
+        self.peak = 0
+        self.done = threading.Event()
+
+    def sample(self):
+        try:
+            with open(self.path) as status:
+                for line in status:
+                    if line.startswith("VmHWM:"):
+                        self.peak = max(self.peak, int(line.split()[1]))
+                        return
+        except OSError:
+            pass
+
+    def run(self):
+        while not self.done.is_set():
+            self.sample()
+            self.done.wait(0.002)
+
+
+def run_once(bcvm, program):
+    """Run the program once, return (seconds, peak RSS in KB, exit code)."""
+    start = time.perf_counter()
+    process = subprocess.Popen([bcvm, program], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    tracker = HighWaterMark(process.pid) if sys.platform.startswith("linux") else None
+    if tracker:
+        tracker.start()
+    # Wait without reaping, so that /proc can be read one last time for the final peak.
+    os.waitid(os.P_PID, process.pid, os.WEXITED | os.WNOWAIT)
+    elapsed = time.perf_counter() - start
+    if tracker:
+        tracker.done.set()
+        tracker.join()
+        tracker.sample()
+    _, status, rusage = os.wait4(process.pid, 0)
+    # Reaped by wait4 already, tell Popen so it does not try again.
+    process.returncode = os.waitstatus_to_exitcode(status)
+    peak = tracker.peak if tracker and tracker.peak else rusage_peak_kb(rusage)
+    return elapsed, peak, process.returncode
+
+
+def run_benchmark(bcvm, program, runs, warmup):
+    name = os.path.splitext(os.path.basename(program))[0]
+    for _ in range(warmup):
+        run_once(bcvm, program)
+
+    times = []
+    peak = 0
+    exit_code = 0
+    for _ in range(runs):
+        elapsed, rss, code = run_once(bcvm, program)
+        times.append(elapsed)
+        peak = max(peak, rss)
+        exit_code = exit_code or code
+
+    return {
+        "name": name,
+        "runs": runs,
+        "median_seconds": round(statistics.median(times), 6),
+        "min_seconds": round(min(times), 6),
+        "max_seconds": round(max(times), 6),
+        "peak_rss_kb": peak,
+        "exit_code": exit_code,
+    }
+
+
+def format_results(results, fmt, bcvm):
+    if fmt == "json":
+        return json.dumps({"bcvm": bcvm, "benchmarks": results}, indent=2) + "\n"
+    out = io.StringIO()
+    writer = csv.DictWriter(out, fieldnames=list(results[0].keys()) if results else ["name"])
+    writer.writeheader()
+    writer.writerows(results)
+    return out.getvalue()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Run the clox benchmark suite.")
+    parser.add_argument("--bcvm", required=True, help="path to the bcvm executable under test")
+    parser.add_argument("--runs", type=int, default=5, help="timed runs per benchmark (default: 5)")
+    parser.add_argument("--warmup", type=int, default=1, help="untimed runs per benchmark (default: 1)")
+    parser.add_argument("--format", choices=["json", "csv"], default="json")
+    parser.add_argument("--output", help="write the report here instead of stdout")
+    parser.add_argument("names", nargs="*", help="benchmarks to run (default: all)")
+    args = parser.parse_args()
+
+    bcvm = os.path.abspath(args.bcvm)
+    programs = sorted(f for f in os.listdir(BENCHMARK_DIR) if f.endswith(".lox"))
+    if args.names:
+        programs = [p for p in programs if os.path.splitext(p)[0] in args.names]
+
+    results = []
+    with tempfile.TemporaryDirectory(prefix="clox-bench-") as scratch:
+        for program in programs:
+            copy = os.path.join(scratch, program)
+            shutil.copyfile(os.path.join(BENCHMARK_DIR, program), copy)
+            result = run_benchmark(bcvm, copy, args.runs, args.warmup)
+            results.append(result)
+            print("%-12s %10.4fs %8d KB%s" % (result["name"], result["median_seconds"], result["peak_rss_kb"],
+                                             "" if result["exit_code"] == 0 else "  (exit %d)" % result["exit_code"]),
+                  file=sys.stderr)
+
+    report = format_results(results, args.format, bcvm)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(report)
+    else:
+        sys.stdout.write(report)
+
+    return 1 if any(r["exit_code"] != 0 for r in results) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
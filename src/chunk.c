@@ -1,38 +1,101 @@
 #include "memory.h"
 #include "chunk.h"
+#include "vm.h"
 
 void initChunk(Chunk *chunk) {
   chunk->capacity = 0;
   chunk->entries = 0;
   chunk->code = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;
+  chunk->globalCaches = NULL;
+  chunk->propertyCacheCount = 0;
+  chunk->propertyCacheCapacity = 0;
+  chunk->propertyCaches = NULL;
   initValueArray(&chunk->constants); // Initilize a constant pool associated with the chunk.
 }
 
-void writeChunk(Chunk *chunk, uint8_t byte, int line) {
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line) {
   if (chunk->capacity < chunk->entries + 1) {
     /* Not enough space, increase capacity of the array. */
     int oldCapacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCapacity);
-    /* Reallocate memory, line numbers array must grow in parallel to the bytecode array. */
-    chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+    chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity, chunk->capacity);
   }
-  /* Write bytecode instruction and the corresponding line number, update entries counter. */
+  /* Write bytecode instruction, update entries counter. */
   chunk->code[chunk->entries] = byte;
-  chunk->lines[chunk->entries] = line;
   chunk->entries++;
+
+  /* Only a byte from a different line than the one before it starts a new run. */
+  if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+    return;
+  }
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(vm, LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+  }
+  LineStart *start = &chunk->lines[chunk->lineCount++];
+  start->offset = chunk->entries - 1;
+  start->line = line;
+}
+
+int getLine(Chunk *chunk, int offset) {
+  /* Find the last run that starts at or before the offset. */
+  int low = 0;
+  int high = chunk->lineCount - 1;
+  while (low < high) {
+    int middle = low + (high - low + 1) / 2;
+    if (chunk->lines[middle].offset <= offset) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return chunk->lines[low].line;
 }
 
-void freeChunk(Chunk *chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+void freeChunk(VM *vm, Chunk *chunk) {
+  FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(vm, LineStart, chunk->lines, chunk->lineCapacity);
+  FREE_ARRAY(vm, GlobalCache, chunk->globalCaches, chunk->constants.capacity);
+  FREE_ARRAY(vm, PropertyCache, chunk->propertyCaches, chunk->propertyCacheCapacity);
   /* Re-init to deal with dangling pointers. */
-  freeValueArray(&chunk->constants);
+  freeValueArray(vm, &chunk->constants);
   initChunk(chunk);
 }
 
-int addConstant(Chunk *chunk, Value value) {
-  writeValueArray(&chunk->constants, value);
-  return chunk->constants.entries - 1; // Return index of the constant being added.
+int addConstant(VM *vm, Chunk *chunk, Value value) {
+  int oldCapacity = chunk->constants.capacity;
+  /* Keep the value reachable while the constant pool grows. */
+  push(vm, value);
+  writeValueArray(vm, &chunk->constants, value);
+  pop(vm);
+
+  /* Every constant may name a global, give it an empty lookup cache. */
+  if (chunk->constants.capacity != oldCapacity) {
+    chunk->globalCaches = GROW_ARRAY(vm, GlobalCache, chunk->globalCaches, oldCapacity, chunk->constants.capacity);
+  }
+  int index = chunk->constants.entries - 1;
+  chunk->globalCaches[index].capacity = -1;
+  chunk->globalCaches[index].slot = 0;
+  return index; // Return index of the constant being added.
+}
+
+int addPropertyCache(VM *vm, Chunk *chunk, int name) {
+  if (chunk->propertyCacheCapacity < chunk->propertyCacheCount + 1) {
+    int oldCapacity = chunk->propertyCacheCapacity;
+    chunk->propertyCacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->propertyCaches = GROW_ARRAY(vm, PropertyCache, chunk->propertyCaches, oldCapacity, chunk->propertyCacheCapacity);
+  }
+  PropertyCache *cache = &chunk->propertyCaches[chunk->propertyCacheCount];
+  cache->name = name;
+  for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+    cache->entries[i].shape = NULL;
+    cache->entries[i].transition = NULL;
+    cache->entries[i].method = NULL;
+    cache->entries[i].slot = -1;
+  }
+  return chunk->propertyCacheCount++;
 }
@@ -34,28 +34,137 @@ typedef enum {
   OP_CLOSURE,
   OP_CLOSE_UPVALUE,
   OP_RETURN,
+  OP_NEW_LIST,
+  OP_LIST_APPEND,
+  OP_INDEX_GET,
+  OP_INDEX_SET,
+  OP_CLASS,
+  OP_INHERIT,
+  OP_METHOD,
+  OP_GET_PROPERTY,        // The operand of the property instructions is a property cache index.
+  OP_SET_PROPERTY,
+  OP_INVOKE,              // A property cache, then the argument count.
+  OP_GET_SUPER,
+  OP_SUPER_INVOKE,        // A constant naming the method, then the argument count.
+  /* Long forms of the instructions above whose operand is a constant, slot or upvalue index.
+  The operand takes three bytes, big-endian, and the compiler only emits these when it does
+  not fit into the single byte of the short form. */
+  OP_CONSTANT_LONG,
+  OP_GET_LOCAL_LONG,
+  OP_SET_LOCAL_LONG,
+  OP_GET_GLOBAL_LONG,
+  OP_DEFINE_GLOBAL_LONG,
+  OP_SET_GLOBAL_LONG,
+  OP_GET_UPVALUE_LONG,
+  OP_SET_UPVALUE_LONG,
+  OP_CLOSURE_LONG,
+  OP_CLASS_LONG,
+  OP_METHOD_LONG,
+  OP_GET_PROPERTY_LONG,
+  OP_SET_PROPERTY_LONG,
+  OP_INVOKE_LONG,
+  OP_GET_SUPER_LONG,
+  OP_SUPER_INVOKE_LONG,
+  /* Superinstructions, selected by the optimizer for common sequences. */
+  OP_ADD_LOCAL_CONST,     // GET_LOCAL, CONSTANT, ADD.
+  OP_INC_LOCAL,           // GET_LOCAL, CONSTANT, ADD, SET_LOCAL, POP on the same slot.
+  OP_LESS_LOCALS_JUMP,    // GET_LOCAL, GET_LOCAL, LESS, JUMP_IF_FALSE.
+  /* Register forms, selected by the optimizer in REGISTER_BYTECODE builds. They name their
+  destination and source slots of the frame directly instead of going through the stack. */
+  OP_MOVE,                // d a:   slots[d] = slots[a].
+  OP_LOADK,               // d k:   slots[d] = constants[k].
+  OP_ADD_RR,              // d a b: slots[d] = slots[a] + slots[b], and so on.
+  OP_SUBTRACT_RR,
+  OP_MULTIPLY_RR,
+  OP_DIVIDE_RR,
+  OP_ADD_RK,              // d a k: slots[d] = slots[a] + constants[k], and so on.
+  OP_SUBTRACT_RK,
+  OP_MULTIPLY_RK,
+  OP_DIVIDE_RK,
+  /* Quickened forms, never emitted by the compiler. The VM rewrites a generic instruction in
+  place into one of these once it has seen its operand types, and back if a guard fails. */
+  OP_EQUAL_NUM,           // OP_EQUAL on two numbers.
+  OP_ADD_NUM,             // OP_ADD on two numbers.
+  OP_ADD_STR,             // OP_ADD on two strings.
+  OP_COUNT                // Not an instruction: the number of opcodes, keep it last.
 } OpCode;
 
+/* Largest operand of the long instruction forms, which also bounds the number of constants,
+locals and upvalues of one function. */
+#define OPERAND_LONG_MAX 0xffffff
+
+/* OP_CLOSURE is followed by one descriptor per upvalue: a flags byte, then the index of the
+captured local slot or enclosing upvalue in one byte, or in three with UPVALUE_LONG. */
+#define UPVALUE_LOCAL 0x01
+#define UPVALUE_LONG  0x02
+
+/* Inline cache for the global variable named by a constant: the bucket of vm.globals where
+it was last found. vm.globals only ever grows, so its capacity identifies one bucket array;
+a resize in adjustCapacity() changes it and implicitly invalidates every cache. */
+typedef struct {
+  int         capacity;     // vm.globals capacity when the slot was recorded, -1 if empty.
+  int         slot;         // Bucket index in vm.globals.entries.
+} GlobalCache;
+
+/* Inline cache of one property instruction: what its property resolved to for the last few
+shapes of receivers it saw. A site that only ever sees one shape hits the first entry, a
+polymorphic one any of them; a further shape evicts the oldest entry. Shapes never change and
+a class has all its methods before it has instances, so an entry stays valid for as long as
+it is cached. It keeps its shapes alive, see blackenObject(). */
+#define PROPERTY_CACHE_WAYS 4
+
+typedef struct {
+  struct ObjShape   *shape;       // The receiver's shape, NULL in an unused entry.
+  struct ObjShape   *transition;  // Set when OP_SET_PROPERTY adds the field: the shape after it.
+  struct ObjClosure *method;      // The method of the class the property names, if not a field.
+  int               slot;         // Index of the field in the instance, -1 for a method.
+} PropertyCacheEntry;
+
+typedef struct {
+  int                 name;       // The constant holding the property name.
+  PropertyCacheEntry  entries[PROPERTY_CACHE_WAYS];
+} PropertyCache;
+
+/* Line information is run-length encoded: a run starts at the offset of the first byte that
+came from a new source line and lasts until the next run starts. */
+typedef struct {
+  int         offset;
+  int         line;
+} LineStart;
+
 /* A bytecode instruction chunk. */
 typedef struct {
   int         capacity;     // dynamic array capacity
   int         entries;      // number of values actually stored in dynamic array
   uint8_t     *code;        // -> array of opcodes
-  int         *lines;       // -> array of line numbers
+  int         lineCount;
+  int         lineCapacity;
+  LineStart   *lines;       // -> runs of line numbers, ordered by offset
   ValueArray  constants;    // -> struct to handle constants
+  GlobalCache *globalCaches; // -> global lookup caches, grown in parallel to the constants
+  int         propertyCacheCount;
+  int         propertyCacheCapacity;
+  PropertyCache *propertyCaches; // -> one per property instruction, in the order they were emitted
 } Chunk;
 
 /* Initialize a bytecode chunk. */
 void initChunk(Chunk *chunk);
 
 /* Append a given byte and its line information to the chunk. */
-void writeChunk(Chunk *chunk, uint8_t byte, int line);
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line);
+
+/* Return the source line of the byte at the given offset, by binary search over the runs. */
+int getLine(Chunk *chunk, int offset);
 
 /* Destroy the existing chunk. */
-void freeChunk(Chunk *chunk);
+void freeChunk(VM *vm, Chunk *chunk);
 
 /* Add the constant to the constant pool. Returns index of element to which 
 the constant was appended.*/
-int addConstant(Chunk *chunk, Value value);
+int addConstant(VM *vm, Chunk *chunk, Value value);
+
+/* Add an empty property cache for an instruction accessing the property named by the given
+constant. Returns its index. */
+int addPropertyCache(VM *vm, Chunk *chunk, int name);
 
 #endif
@@ -0,0 +1,184 @@
+#include "clox.h"
+#include "common.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+CloxVM* cloxNewVM(void) {
+  VM *vm = (VM*)malloc(sizeof(VM));
+  if (vm == NULL) {
+    return NULL;
+  }
+  initVM(vm);
+  return vm;
+}
+
+void cloxFreeVM(CloxVM *vm) {
+  freeVM(vm);
+  free(vm);
+}
+
+/* Link a handle on the closure into the VM's roots. */
+static CloxFunction* holdClosure(VM *vm, ObjClosure *closure) {
+  CloxFunction *function = (CloxFunction*)malloc(sizeof(CloxFunction));
+  if (function == NULL) {
+    return NULL;
+  }
+  function->closure = closure;
+  function->previous = NULL;
+  function->next = vm->hostFunctions;
+  if (vm->hostFunctions != NULL) {
+    vm->hostFunctions->previous = function;
+  }
+  vm->hostFunctions = function;
+  return function;
+}
+
+CloxFunction* cloxCompile(CloxVM *vm, const char *source, size_t length) {
+  ObjFunction *script = compile(vm, source, length);
+  if (script == NULL) {
+    return NULL;
+  }
+  push(vm, OBJ_VAL(script));
+  ObjClosure *closure = newClosure(vm, script);
+  pop(vm);
+  return holdClosure(vm, closure);
+}
+
+/* Globals are keyed by interned strings, so looking one up by name interns the name. */
+static bool getGlobal(VM *vm, const char *name, Value *value) {
+  ObjString *key = copyString(vm, name, (int)strlen(name));
+  return tableGet(&vm->globals, key, value);
+}
+
+CloxFunction* cloxGetFunction(CloxVM *vm, const char *name) {
+  Value value;
+  if (!getGlobal(vm, name, &value) || !IS_CLOSURE(value)) {
+    return NULL;
+  }
+  return holdClosure(vm, AS_CLOSURE(value));
+}
+
+void cloxReleaseFunction(CloxVM *vm, CloxFunction *function) {
+  if (function->previous != NULL) {
+    function->previous->next = function->next;
+  } else {
+    vm->hostFunctions = function->next;
+  }
+  if (function->next != NULL) {
+    function->next->previous = function->previous;
+  }
+  free(function);
+}
+
+static Value toValue(VM *vm, const CloxValue *value) {
+  switch (value->type) {
+    case CLOX_BOOL:   return BOOL_VAL(value->as.boolean);
+    case CLOX_NUMBER: return NUMBER_VAL(value->as.number);
+    case CLOX_STRING: return OBJ_VAL(copyString(vm, value->as.string.chars, value->as.string.length));
+    default:          return NIL_VAL;
+  }
+}
+
+static void fromValue(VM *vm, Value value, CloxValue *result) {
+  if (IS_NIL(value)) {
+    result->type = CLOX_NIL;
+  } else if (IS_BOOL(value)) {
+    result->type = CLOX_BOOL;
+    result->as.boolean = AS_BOOL(value);
+  } else if (IS_NUMBER(value)) {
+    result->type = CLOX_NUMBER;
+    result->as.number = AS_NUMBER(value);
+  } else if (IS_STRING(value)) {
+    ObjString *string = AS_STRING(value);
+    flattenString(vm, string);
+    result->type = CLOX_STRING;
+    result->as.string.chars = string->chars;
+    result->as.string.length = string->length;
+  } else {
+    result->type = CLOX_OBJECT;
+  }
+}
+
+/* Hand a finished call's return value to the host and take it off the stack. */
+static CloxResult finishCall(VM *vm, InterpretResult status, CloxValue *result) {
+  switch (status) {
+    case INTERPRET_OK:
+      /* Convert before popping, flattening a rope may collect. */
+      if (result != NULL) {
+        fromValue(vm, vm->stackTop[-1], result);
+      }
+      pop(vm);
+      return CLOX_OK;
+    case INTERPRET_YIELD:         return CLOX_YIELD;
+    case INTERPRET_COMPILE_ERROR: return CLOX_COMPILE_ERROR;
+    default:                      return CLOX_RUNTIME_ERROR;
+  }
+}
+
+CloxResult cloxCall(CloxVM *vm, CloxFunction *function, int argCount, const CloxValue *args,
+                    CloxValue *result) {
+  if (vm->frameCount != 0) {
+    fprintf(stderr, "cloxCall() cannot be used while a script is running or suspended.\n");
+    return CLOX_RUNTIME_ERROR;
+  }
+
+  /* Each argument is on the stack before the next one allocates. */
+  push(vm, OBJ_VAL(function->closure));
+  for (int i = 0; i < argCount; i++) {
+    push(vm, toValue(vm, &args[i]));
+  }
+  return finishCall(vm, callFunction(vm, argCount), result);
+}
+
+void cloxSetTimeSlice(CloxVM *vm, unsigned long long steps, unsigned long long microseconds) {
+  setTimeSlice(vm, steps, microseconds);
+}
+
+CloxResult cloxResume(CloxVM *vm, CloxValue *result) {
+  return finishCall(vm, resumeScript(vm), result);
+}
+
+void cloxAbort(CloxVM *vm) {
+  abortScript(vm);
+}
+
+bool cloxGetGlobal(CloxVM *vm, const char *name, CloxValue *value) {
+  Value global;
+  if (!getGlobal(vm, name, &global)) {
+    return false;
+  }
+  /* The global itself keeps the value alive while it is converted. */
+  fromValue(vm, global, value);
+  return true;
+}
+
+void cloxGetHeapStats(CloxVM *vm, CloxHeapStats *stats) {
+  HeapStats heap;
+  getHeapStats(vm, &heap);
+  stats->bytes = heap.bytesAllocated;
+  stats->peakBytes = heap.peakBytesAllocated;
+  stats->totalBytes = heap.totalBytesAllocated;
+  stats->nextGC = heap.nextGC;
+  stats->collections = heap.collections;
+  stats->fullCollections = heap.fullCollections;
+  stats->objects = 0;
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    stats->objects += heap.objectCounts[i];
+  }
+  stats->globals = heap.globals.live;
+  stats->globalsCapacity = heap.globals.capacity;
+  stats->strings = heap.strings.live;
+  stats->stringsCapacity = heap.strings.capacity;
+}
+
+int cloxObjectCount(CloxVM *vm, const char *type) {
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    if (strcmp(objectTypeName((ObjType)i), type) == 0) {
+      return vm->objectCounts[i];
+    }
+  }
+  return -1;
+}
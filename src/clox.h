@@ -0,0 +1,111 @@
+/* This module is the embedding API of the interpreter, the one header a host needs. It only
+exposes opaque handles and plain C values, so hosts do not depend on the VM's internals. */
+
+#ifndef clox_h
+#define clox_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct VM CloxVM;
+
+/* A Lox function held by the host. It stays valid until cloxReleaseFunction() or cloxFreeVM(). */
+typedef struct CloxFunction CloxFunction;
+
+typedef enum {
+  CLOX_OK,
+  CLOX_COMPILE_ERROR,
+  CLOX_RUNTIME_ERROR,
+  CLOX_YIELD,       // The time slice ran out, see cloxSetTimeSlice().
+} CloxResult;
+
+typedef enum {
+  CLOX_NIL,
+  CLOX_BOOL,
+  CLOX_NUMBER,
+  CLOX_STRING,
+  CLOX_OBJECT,      // Any other object; only returned to the host, it cannot be passed back in.
+} CloxType;
+
+/* A Lox value on the host side. Strings passed in are copied. Strings handed out point into the
+VM's heap and are only valid until the next call into the same VM. */
+typedef struct {
+  CloxType  type;
+  union {
+    bool    boolean;
+    double  number;
+    struct {
+      const char  *chars;
+      int         length;
+    } string;
+  } as;
+} CloxValue;
+
+/* Create an independent interpreter with the core natives defined. VMs share nothing, but a VM
+must only be used by one thread at a time. */
+CloxVM* cloxNewVM(void);
+
+/* Destroy the VM along with every function handle still held on it. */
+void cloxFreeVM(CloxVM *vm);
+
+/* Compile a script once into a function taking no arguments. Calling it runs the script's
+top-level code. Returns NULL and reports the errors on stderr when the source does not compile. */
+CloxFunction* cloxCompile(CloxVM *vm, const char *source, size_t length);
+
+/* A handle on the Lox function stored in the named global, NULL if there is none. */
+CloxFunction* cloxGetFunction(CloxVM *vm, const char *name);
+
+void cloxReleaseFunction(CloxVM *vm, CloxFunction *function);
+
+/* Call a function with the given arguments and store its return value in result, which may be
+NULL. A runtime error is reported on stderr. Not callable from inside a running script, nor
+while one is suspended. */
+CloxResult cloxCall(CloxVM *vm, CloxFunction *function, int argCount, const CloxValue *args,
+                    CloxValue *result);
+
+/* Suspend calls after about the given number of steps (loop iterations and calls) or
+microseconds, whichever comes first, so that one host thread can take turns between many VMs.
+Zero lifts a limit; there are none by default. A suspended call returns CLOX_YIELD. */
+void cloxSetTimeSlice(CloxVM *vm, unsigned long long steps, unsigned long long microseconds);
+
+/* Continue the suspended call for another slice, like cloxCall() would have. The VM may be
+resumed from a different thread than the one that started the call. */
+CloxResult cloxResume(CloxVM *vm, CloxValue *result);
+
+/* Give up on the suspended call. */
+void cloxAbort(CloxVM *vm);
+
+/* Read the named global into value. Returns false if it is not defined. */
+bool cloxGetGlobal(CloxVM *vm, const char *name, CloxValue *value);
+
+/* A snapshot of the memory use of a VM, the figures heapStat() gives scripts. */
+typedef struct {
+  size_t              bytes;              // Currently allocated.
+  size_t              peakBytes;
+  size_t              totalBytes;         // Allocated over the life of the VM.
+  size_t              nextGC;             // Allocated bytes that trigger the next collection.
+  unsigned long long  collections;
+  unsigned long long  fullCollections;
+  int                 objects;            // Live objects of every type.
+  int                 globals;
+  int                 globalsCapacity;
+  int                 strings;            // Entries of the intern table.
+  int                 stringsCapacity;
+} CloxHeapStats;
+
+/* Sample the heap statistics, cheap enough to call between calls into the VM. */
+void cloxGetHeapStats(CloxVM *vm, CloxHeapStats *stats);
+
+/* Live objects of one type, named as for objectCount() ("closure", "string", ...), or -1 if
+there is no such type. */
+int cloxObjectCount(CloxVM *vm, const char *type);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef clox_common_h
 #define clox_common_h
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -9,8 +10,46 @@
 #include <string.h>
 #include <stdarg.h>
 
-#define DEBUG_TRACE_EXECUTION
-#define DEBUG_PRINT_CODE
+/* Tracing and code dumps are for debug builds, release builds (NDEBUG) run quietly. */
+#ifndef NDEBUG
+  #define DEBUG_TRACE_EXECUTION
+  #define DEBUG_PRINT_CODE
+#endif
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
+// #define DEBUG_SYSTEM_ALLOCATOR
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+/* Every runtime entry point takes the interpreter instance explicitly, see vm.h. */
+typedef struct VM VM;
+
+/* Per-thread storage for the compiler and scanner state, so that separate VMs can compile
+on separate threads at the same time. */
+#if defined(_MSC_VER)
+  #define THREAD_LOCAL __declspec(thread)
+#else
+  #define THREAD_LOCAL _Thread_local
+#endif
+
+/* Keep rarely taken slow paths out of line, so that the fast path they hang off of, like
+push(), stays small enough to be inlined into the dispatch loop. */
+#if defined(_MSC_VER)
+  #define NOINLINE __declspec(noinline)
+#elif defined(__GNUC__)
+  #define NOINLINE __attribute__((noinline))
+#else
+  #define NOINLINE
+#endif
+
+/* Release builds run the peephole optimizer over every compiled function, debug builds keep
+the bytecode exactly as the compiler emitted it. */
+#if defined(NDEBUG) && !defined(NO_OPTIMIZE)
+  #define OPTIMIZE_BYTECODE
+#endif
+
+/* Threaded dispatch in run() relies on GCC/Clang labels-as-values, other compilers use the switch. */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+  #define COMPUTED_GOTO
+#endif
+
 #endif
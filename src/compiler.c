@@ -2,18 +2,52 @@
 #include "compiler.h"
 #include "scanner.h"
 #include "object.h"
+#include "memory.h"
+#include "vm.h"
 #include <stdint.h>
 
 #ifdef DEBUG_PRINT_CODE
   #include "debug.h"
 #endif
 
+#ifdef OPTIMIZE_BYTECODE
+  #include "optimizer.h"
+#endif
+
+/* Disassembly from several threads would interleave, so debug builds always compile serially. */
+#if defined(PARALLEL_COMPILE) && !defined(DEBUG_PRINT_CODE)
+  #define COMPILE_IN_PARALLEL
+  #include <pthread.h>
+  #include <stdatomic.h>
+  #include <unistd.h>
+#endif
+
+/* Scripts shorter than this are not worth starting threads for. */
+#ifndef PARALLEL_COMPILE_MIN_LENGTH
+  #define PARALLEL_COMPILE_MIN_LENGTH (64 * 1024)
+#endif
+#define PARALLEL_COMPILE_MAX_THREADS 32
+
+/* A function declared at the top level of a script, compiled ahead by a parallel worker. Its
+body names nothing but its own locals and globals, so it compiles the same on its own. */
+typedef struct {
+  const char  *name;      // Where the function's name starts in the source.
+  int         line;       // The line of the name.
+  Token       close;      // The '}' that ends the body.
+  ObjFunction *function;  // In the worker's VM. NULL if the body did not compile cleanly.
+} Unit;
+
 /* A compiler registers. */
 typedef struct Parser_ {
   Token   current;
   Token   previous;
   bool    hadError;   // Indicates whether any errors occurred during compilation.
   bool    panicMode;  // Tracks whether compiler is currently in panic mode.
+  bool    silent;     // Set on parallel workers, the errors are reported by the main compile.
+  VM      *vm;        // The instance that owns every object created during compilation.
+  Unit    *units;     // Compiled ahead, in source order, see compileInParallel().
+  int     unitCount;
+  int     nextUnit;   // The first unit the compiler has not reached yet.
 } Parser;
 
 typedef struct {
@@ -23,12 +57,14 @@ typedef struct {
 } Local;
 
 typedef struct {
-  uint8_t   index;
+  int       index;
   bool      isLocal; // Controls whether the closure captures a local variable or an upvalue from the surrounding function.
 } Upvalue;
 
 typedef enum {
   TYPE_FUNCTION,
+  TYPE_INITIALIZER,
+  TYPE_METHOD,
   TYPE_SCRIPT
 } FunctionType;
 
@@ -37,12 +73,20 @@ typedef struct Compiler {
   struct Compiler *enclosing;
   ObjFunction     *function;
   FunctionType    type;                   // Indicates when we are compiling top-level code vs the body of a function.
-  Local           locals[UINT8_COUNT];
+  Local           *locals;                // Grown on demand, see addLocal().
   int             localCount;             // How many of locals are in scope.
-  Upvalue         upvalues[UINT8_COUNT];  // Closed-over local variable’s slot index array.
+  int             localCapacity;
+  Upvalue         *upvalues;              // Closed-over local variable’s slot index array.
+  int             upvalueCapacity;
   int             scopeDepth;             // Number of blocks surrounding the current bit of code being compiled.
 } Compiler;
 
+/* The class declaration being compiled, innermost first. */
+typedef struct ClassCompiler {
+  struct ClassCompiler  *enclosing;
+  bool                  hasSuperclass;
+} ClassCompiler;
+
 /* A oprator precedence numerical definition: C implicitly gives successively 
 larger numbers for enums, this means that PREC_CALL is numerically > than PREC_UNARY. */
 typedef enum Precedence_ {
@@ -75,14 +119,17 @@ static void statement();
 static void declaration();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
-static uint8_t identifierConstant(Token* name);
+static int identifierConstant(Token* name);
 static int resolveLocal(Compiler *compiler, Token *name);
 static int resolveUpvalue(Compiler *compiler, Token *name);
+static void addLocal(Token name);
 static void and_(bool canAssign);
 static uint8_t argumentList();
 
-Parser parser;
-Compiler *current = NULL;
+/* The front end state is per-thread, so that independent VMs can compile concurrently. */
+THREAD_LOCAL Parser parser;
+THREAD_LOCAL Compiler *current = NULL;
+THREAD_LOCAL ClassCompiler *currentClass = NULL;
 
 static Chunk* currentChunk() {
   return &current->function->chunk;
@@ -90,7 +137,7 @@ static Chunk* currentChunk() {
 
 /* An intermediary global variable and corresponding function to pass the chunk 
 from front end (compile() function) to the compiler's internal sub-routines. */
-Chunk *compilingChunk;
+THREAD_LOCAL Chunk *compilingChunk;
 
 /* ERROR HANDLING */
 static void errorAt(Token *token, const char *message) {
@@ -100,6 +147,10 @@ static void errorAt(Token *token, const char *message) {
   }
 
   parser.panicMode = true; // Enable panic mode when an error has occured.
+  parser.hadError = true;
+  if (parser.silent) {
+    return;
+  }
 
   /* Display a location in the source code where encountered error is found. */
   fprintf(stderr, "[Line %d] Error", token->line);
@@ -113,9 +164,8 @@ static void errorAt(Token *token, const char *message) {
     // Try to display the lexeme if it’s human-readable.
     fprintf(stderr, " at '%.*s'", token->length, token->start);
   }
-  /* Print the error message and set hadError flag. */
+  /* Print the error message. */
   fprintf(stderr, ": %s\n", message);
-  parser.hadError = true;
 }
 
 /* Report an error at the location of the token just consumed. */
@@ -176,7 +226,7 @@ static bool match(TokenType type) {
 /* Append a single byte (opcode or operand to an instruction) to the chunk.
 Send the previous token’s line info so that runtime errors are associated with that line. */
 static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk(), byte, parser.previous.line);
+  writeChunk(parser.vm, currentChunk(), byte, parser.previous.line);
 }
 
 /* Write an opcode followed by a one-byte operand. */
@@ -185,6 +235,19 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
+/* Emit an instruction with a one-byte operand when the operand fits, otherwise its long form
+with a 24-bit operand. */
+static void emitOperand(uint8_t instruction, uint8_t longInstruction, int operand) {
+  if (operand <= UINT8_MAX) {
+    emitBytes(instruction, (uint8_t)operand);
+    return;
+  }
+  emitByte(longInstruction);
+  emitByte((operand >> 16) & 0xff);
+  emitByte((operand >> 8) & 0xff);
+  emitByte(operand & 0xff);
+}
+
 /* Emit a new loop instruction, which unconditionally jumps backwards by a given offset. */
 static void emitLoop(int loopStart) {
   emitByte(OP_LOOP);
@@ -209,28 +272,35 @@ static int emitJump(uint8_t instruction) {
 /* To print the result, we temporarily use the OP_RETURN instruction.
 So we have the compiler add one of those to the end of the chunk. */
 static void emitReturn() {
-  emitByte(OP_NIL);
+  /* An initializer returns the instance it was called on, which lives in slot zero. */
+  if (current->type == TYPE_INITIALIZER) {
+    emitBytes(OP_GET_LOCAL, 0);
+  } else {
+    emitByte(OP_NIL);
+  }
   emitByte(OP_RETURN);
 }
 
 /* Insert an entry to the constant table. */
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
   /* Add the given value to the end of the chunk’s constant table and return its index. */
-  int constant = addConstant(currentChunk(), value);
+  int constant = addConstant(parser.vm, currentChunk(), value);
+  /* The function may have been promoted to the old generation while it was being compiled. */
+  WRITE_BARRIER(parser.vm, current->function);
 
-  /* Make sure the number of constants does not exceed the limit of the stack (256). */
-  if (constant > UINT8_MAX) {
+  /* Make sure the number of constants does not exceed what a long operand can address. */
+  if (constant > OPERAND_LONG_MAX) {
     error("Too many constants in one chunk.");
     return 0;
   }
   /* Return constant index. */
-  return (uint8_t)constant;
+  return constant;
 }
 
 /* Generate the code to load converted the number literal value to the VM stack. */
 static void emitConstant(Value value) {
   // Write opcode, followed by the index where the constant value is stored.
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  emitOperand(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
 }
 
 /* Backpatching: This goes back into the bytecode and replaces the operand 
@@ -251,31 +321,43 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
+  compiler->upvalues = NULL;
+  compiler->upvalueCapacity = 0;
   compiler->scopeDepth = 0;
-  compiler->function = newFunction();
+  compiler->function = newFunction(parser.vm);
   current = compiler;
 
   if (type != TYPE_SCRIPT) {
-    current->function->name = copyString(parser.previous.start, parser.previous.length);
+    current->function->name = copyString(parser.vm, parser.previous.start, parser.previous.length);
+    WRITE_BARRIER(parser.vm, current->function);
   }
 
-  /* Claims stack slot zero for the VM’s internal use. No longer accessible to user. */
-  Local *local = &current->locals[current->localCount++];
-  local->depth = 0;
-  local->isCaptured = false;
-  local->name.start = "";
-  local->name.length = 0;
+  /* Claims stack slot zero for the VM’s internal use. Methods keep the receiver there, as "this". */
+  Token name;
+  name.start = type != TYPE_FUNCTION && type != TYPE_SCRIPT ? "this" : "";
+  name.length = (int)strlen(name.start);
+  addLocal(name);
+  current->locals[0].depth = 0;
 }
 
 static ObjFunction* endCompiler() {
   emitReturn();
   ObjFunction *function = current->function;
+#ifdef OPTIMIZE_BYTECODE
+  /* Still reachable through current while the optimizer allocates folded constants. */
+  if (!parser.hadError) {
+    optimizeFunction(parser.vm, function);
+  }
+#endif
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
     disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
   }
 #endif
+  FREE_ARRAY(parser.vm, Local, current->locals, current->localCapacity);
   current = current->enclosing;
   return function;
 }
@@ -328,6 +410,67 @@ static void call(bool canAssign) {
   emitBytes(OP_CALL, argCount);
 }
 
+/* Give the next property instruction its own inline cache, for the property named by the
+identifier just consumed. */
+static int propertyCache() {
+  int name = identifierConstant(&parser.previous);
+  if (currentChunk()->propertyCacheCount > OPERAND_LONG_MAX) {
+    error("Too many property accesses in one chunk.");
+    return 0;
+  }
+  return addPropertyCache(parser.vm, currentChunk(), name);
+}
+
+/* Emit a call of the method or field named by an operand, followed by the argument count. */
+static void emitInvoke(uint8_t instruction, uint8_t longInstruction, int operand, uint8_t argCount) {
+  emitOperand(instruction, longInstruction, operand);
+  emitByte(argCount);
+}
+
+/* A property access after the instance expression: a read, a write when it is the target of an
+assignment, or a method call that skips the bound method a read would create. */
+static void dot(bool canAssign) {
+  consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  int cache = propertyCache();
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitOperand(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, cache);
+  } else if (match(TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList();
+    emitInvoke(OP_INVOKE, OP_INVOKE_LONG, cache, argCount);
+  } else {
+    emitOperand(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, cache);
+  }
+}
+
+/* A list literal creates an empty list and appends the elements one at a time, so that
+literals are not limited to the 255 elements a single byte operand could count. */
+static void list(bool canAssign) {
+  emitByte(OP_NEW_LIST);
+  if (!check(TOKEN_RIGHT_BRACKET)) {
+    do {
+      expression();
+      emitByte(OP_LIST_APPEND);
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+}
+
+/* Compile an index expression after the list expression, then either a read or, when it is
+the target of an assignment, a write of the element. */
+static void subscript(bool canAssign) {
+  expression();
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitByte(OP_INDEX_SET);
+  } else {
+    emitByte(OP_INDEX_GET);
+  }
+}
+
 static void literal(bool canAssign) {
   switch (parser.previous.type) {
     case TOKEN_FALSE: emitByte(OP_FALSE); break;
@@ -350,8 +493,23 @@ static void grouping(bool canAssign) {
 
 /* A function to compile number literals. */
 static void number(bool canAssign) {
+  /* The source may be mapped straight from the file with no terminator after it, so strtod()
+  parses a NUL-terminated copy of the lexeme. Only absurdly long literals need the heap. */
+  char buffer[64];
+  int length = parser.previous.length;
+  char *text = length < (int)sizeof(buffer) ? buffer : (char*)malloc(length + 1);
+  if (text == NULL) {
+    error("Not enough memory for the number literal.");
+    return;
+  }
+  memcpy(text, parser.previous.start, length);
+  text[length] = '\0';
+
   // Convert a lexeme to a double value using C std. library, then pass it to the code gen function.
-  double value = strtod(parser.previous.start, NULL);
+  double value = strtod(text, NULL);
+  if (text != buffer) {
+    free(text);
+  }
   emitConstant(NUMBER_VAL(value)); // Convert to Lox internal representation and set the tag.
 }
 
@@ -369,22 +527,28 @@ static void or_(bool canAssign) {
 /* Extract the string’s characters directly from the lexeme, trim the leading and trailing quotation 
 marks, then create a string object, wrap it in a Value, and stuffs it into the constant table. */
 static void string(bool canAssign) {
-  emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+  emitConstant(OBJ_VAL(copyLiteralString(parser.vm, parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 static void namedVariable(Token name, bool canAssign) {
-  uint8_t getOp, setOp;
+  uint8_t getOp, setOp, getLongOp, setLongOp;
   int arg = resolveLocal(current, &name);
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
+    getLongOp = OP_GET_LOCAL_LONG;
+    setLongOp = OP_SET_LOCAL_LONG;
   } else if ((arg = resolveUpvalue(current, &name)) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
+    getLongOp = OP_GET_UPVALUE_LONG;
+    setLongOp = OP_SET_UPVALUE_LONG;
   } else {
     arg = identifierConstant(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
+    getLongOp = OP_GET_GLOBAL_LONG;
+    setLongOp = OP_SET_GLOBAL_LONG;
   }
 
   /*
@@ -394,9 +558,9 @@ static void namedVariable(Token name, bool canAssign) {
   */
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg);
+    emitOperand(setOp, setLongOp, arg);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitOperand(getOp, getLongOp, arg);
   }
 }
 
@@ -404,6 +568,48 @@ static void variable(bool canAssign) {
   namedVariable(parser.previous, canAssign);
 }
 
+/* An identifier the user can not write, for the locals that the compiler declares itself. */
+static Token syntheticToken(const char *text) {
+  Token token;
+  token.type = TOKEN_IDENTIFIER;
+  token.start = text;
+  token.length = (int)strlen(text);
+  token.line = parser.previous.line;
+  return token;
+}
+
+/* The superclass of a method's class lives in a local named "super" around the methods, the
+methods capture it like any other variable. */
+static void super_(bool canAssign) {
+  if (currentClass == NULL) {
+    error("Can't use 'super' outside of a class.");
+  } else if (!currentClass->hasSuperclass) {
+    error("Can't use 'super' in a class with no superclass.");
+  }
+
+  consume(TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+  int name = identifierConstant(&parser.previous);
+
+  namedVariable(syntheticToken("this"), false);
+  if (match(TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList();
+    namedVariable(syntheticToken("super"), false);
+    emitInvoke(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name, argCount);
+  } else {
+    namedVariable(syntheticToken("super"), false);
+    emitOperand(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
+  }
+}
+
+static void this_(bool canAssign) {
+  if (currentClass == NULL) {
+    error("Can't use 'this' outside of a class.");
+    return;
+  }
+  variable(false);
+}
+
 /* A function to compile unary operators. */
 static void unary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
@@ -427,8 +633,10 @@ ParseRule rules[] = {
   [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
   [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE}, 
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACKET]  = {list,     subscript, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_DOT]           = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
   [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
   [TOKEN_PLUS]          = {NULL,     binary, PREC_TERM},
   [TOKEN_SEMICOLON]     = {NULL,     NULL,   PREC_NONE},
@@ -456,8 +664,8 @@ ParseRule rules[] = {
   [TOKEN_OR]            = {NULL,     or_,    PREC_OR},
   [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_SUPER]         = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_THIS]          = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_SUPER]         = {super_,   NULL,   PREC_NONE},
+  [TOKEN_THIS]          = {this_,    NULL,   PREC_NONE},
   [TOKEN_TRUE]          = {literal,  NULL,   PREC_NONE},
   [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE},
@@ -508,8 +716,8 @@ static void parsePrecedence(Precedence precedence) {
 
 /* Take the given token and add its lexeme to the chunk’s constant table as a string. 
 It then returns the index of that constant in the constant table. */
-static uint8_t identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static int identifierConstant(Token* name) {
+  return makeConstant(OBJ_VAL(copyString(parser.vm, name->start, name->length)));
 }
 
 static bool identifiersEqual(Token *a, Token *b) {
@@ -536,7 +744,7 @@ static int resolveLocal(Compiler *compiler, Token *name) {
   return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler* compiler, int index, bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
   // Check for multiple variable cross-reference by a closure
   for (int i = 0; i < upvalueCount; i++) {
@@ -546,10 +754,15 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
     }
   }
 
-  if (upvalueCount == UINT8_COUNT) {
+  if (upvalueCount > OPERAND_LONG_MAX) {
     error("Too many closure variables in function.");
     return 0;
   }
+  if (upvalueCount == compiler->upvalueCapacity) {
+    int oldCapacity = compiler->upvalueCapacity;
+    compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->upvalues = GROW_ARRAY(parser.vm, Upvalue, compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+  }
 
   compiler->upvalues[upvalueCount].isLocal = isLocal;
   compiler->upvalues[upvalueCount].index = index;
@@ -567,14 +780,14 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    return addUpvalue(compiler, local, true);
   }
 
   // Allow a closure to capture either a local variable or an existing upvalue
   // in the immediately enclosing function.
   int upvalue = resolveUpvalue(compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t)upvalue, false);
+    return addUpvalue(compiler, upvalue, false);
   }
 
   return -1;
@@ -583,10 +796,15 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
 /* Initializes the next available Local in the compiler’s array of variables.
 It stores the variable’s name and the depth of the scope that owns the variable. */
 static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
+  if (current->localCount > OPERAND_LONG_MAX) {
     error("Too many local variables in function.");
     return;
   }
+  if (current->localCount == current->localCapacity) {
+    int oldCapacity = current->localCapacity;
+    current->localCapacity = GROW_CAPACITY(oldCapacity);
+    current->locals = GROW_ARRAY(parser.vm, Local, current->locals, oldCapacity, current->localCapacity);
+  }
 
   Local *local = &current->locals[current->localCount++];
   local->name = name;
@@ -619,7 +837,7 @@ static void declareVariable() {
   addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
   /* It requires the next token to be an identifier, which it consumes and passes over to identfierConstant(). */
   consume(TOKEN_IDENTIFIER, errorMessage);
   
@@ -640,7 +858,7 @@ static void markInitialized() {
   current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
   /* Emit the code to store a local variable if we’re in a local scope. */
   if (current->scopeDepth > 0) {
     markInitialized();
@@ -649,7 +867,7 @@ static void defineVariable(uint8_t global) {
 
   /* We store the string in the constant table and the instruction then refers to the name by its index in the table. 
 T his outputs the bytecode instruction that defines the new variable and stores its initial value. */
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitOperand(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
 static uint8_t argumentList() {
@@ -698,10 +916,11 @@ static void block() {
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
-  Compiler compiler;
-  initCompiler(&compiler, type);
-  beginScope(); 
+/* Compile the parameters and the body of a function whose name was just consumed. The caller
+frees compiler->upvalues once it is done with them. */
+static ObjFunction* functionBody(Compiler *compiler, FunctionType type) {
+  initCompiler(compiler, type);
+  beginScope();
 
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
   if (!check(TOKEN_RIGHT_PAREN)) {
@@ -710,32 +929,175 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         errorAtCurrent("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      int constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
   consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
   block();
+  return endCompiler();
+}
 
-  ObjFunction *function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+static void function(FunctionType type) {
+  Compiler compiler;
+  ObjFunction *function = functionBody(&compiler, type);
+  emitOperand(OP_CLOSURE, OP_CLOSURE_LONG, makeConstant(OBJ_VAL(function)));
 
+  /* The upvalues outlive endCompiler(), they are only needed for these descriptors. */
   for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    int index = compiler.upvalues[i].index;
+    uint8_t flags = compiler.upvalues[i].isLocal ? UPVALUE_LOCAL : 0;
+    if (index <= UINT8_MAX) {
+      emitBytes(flags, (uint8_t)index);
+    } else {
+      emitByte(flags | UPVALUE_LONG);
+      emitByte((index >> 16) & 0xff);
+      emitByte((index >> 8) & 0xff);
+      emitByte(index & 0xff);
+    }
   }
+  FREE_ARRAY(parser.vm, Upvalue, compiler.upvalues, compiler.upvalueCapacity);
+}
+
+/* Copy a function compiled by a parallel worker, and every function nested in it, into the VM.
+The worker's heap is left alone, it is freed as a whole once the compile is over. */
+static ObjFunction* adoptFunction(VM *vm, ObjFunction *source) {
+  ObjFunction *function = newFunction(vm);
+  /* Everything below allocates, keep the function reachable until it is a constant. */
+  push(vm, OBJ_VAL(function));
+  function->arity = source->arity;
+  function->upvalueCount = source->upvalueCount;
+  function->name = copyString(vm, source->name->chars, source->name->length);
+  WRITE_BARRIER(vm, function);
+
+  Chunk *chunk = &function->chunk;
+  Chunk *from = &source->chunk;
+  chunk->code = ALLOCATE(vm, uint8_t, from->entries);
+  memcpy(chunk->code, from->code, from->entries);
+  chunk->capacity = from->entries;
+  chunk->entries = from->entries;
+  chunk->lines = ALLOCATE(vm, LineStart, from->lineCount);
+  memcpy(chunk->lines, from->lines, sizeof(LineStart) * from->lineCount);
+  chunk->lineCapacity = from->lineCount;
+  chunk->lineCount = from->lineCount;
+
+  for (int i = 0; i < from->constants.entries; i++) {
+    Value constant = from->constants.values[i];
+    if (IS_STRING(constant)) {
+      /* Keep interned strings interned whatever their length: identifiers are compared by
+      identity, a long field or global name copied as a literal would not match. */
+      ObjString *string = AS_STRING(constant);
+      ObjString *copy = string->isInterned ? copyString(vm, string->chars, string->length)
+                                           : copyLiteralString(vm, string->chars, string->length);
+      constant = OBJ_VAL(copy);
+    } else if (IS_FUNCTION(constant)) {
+      constant = OBJ_VAL(adoptFunction(vm, AS_FUNCTION(constant)));
+    }
+    addConstant(vm, chunk, constant);
+    WRITE_BARRIER(vm, function);
+  }
+  for (int i = 0; i < from->propertyCacheCount; i++) {
+    addPropertyCache(vm, chunk, from->propertyCaches[i].name);
+  }
+  pop(vm);
+  return function;
+}
+
+/* Use the body a parallel worker compiled for the top-level function whose name was just
+consumed, if there is one. The scanner then carries on after it, as if it had been compiled
+here. */
+static bool takeUnit() {
+  while (parser.nextUnit < parser.unitCount && parser.units[parser.nextUnit].name < parser.previous.start) {
+    parser.nextUnit++;
+  }
+  if (parser.nextUnit == parser.unitCount || current->enclosing != NULL || current->scopeDepth > 0) {
+    return false;
+  }
+  Unit *unit = &parser.units[parser.nextUnit];
+  if (unit->name != parser.previous.start || unit->function == NULL) {
+    return false;
+  }
+  parser.nextUnit++;
+
+  ObjFunction *function = adoptFunction(parser.vm, unit->function);
+  seekScanner(unit->close.start + unit->close.length, unit->close.line);
+  parser.current = unit->close;
+  advance();
+  emitOperand(OP_CLOSURE, OP_CLOSURE_LONG, makeConstant(OBJ_VAL(function)));
+  return true;
+}
+
+static void method() {
+  consume(TOKEN_IDENTIFIER, "Expect method name.");
+  int constant = identifierConstant(&parser.previous);
+
+  FunctionType type = TYPE_METHOD;
+  if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
+    type = TYPE_INITIALIZER;
+  }
+  function(type);
+  emitOperand(OP_METHOD, OP_METHOD_LONG, constant);
+}
+
+/* The class is created empty and bound to its name before anything else, so that its methods
+can refer to it. It then stays on the stack while the superclass and each method is added. */
+static void classDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = parser.previous;
+  int nameConstant = identifierConstant(&parser.previous);
+  declareVariable();
+
+  emitOperand(OP_CLASS, OP_CLASS_LONG, nameConstant);
+  defineVariable(nameConstant);
+
+  ClassCompiler classCompiler;
+  classCompiler.hasSuperclass = false;
+  classCompiler.enclosing = currentClass;
+  currentClass = &classCompiler;
+
+  if (match(TOKEN_LESS)) {
+    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(false);
+    if (identifiersEqual(&className, &parser.previous)) {
+      error("A class can't inherit from itself.");
+    }
+
+    /* A scope of its own, so that each class declared in the same scope has its own "super". */
+    beginScope();
+    addLocal(syntheticToken("super"));
+    defineVariable(0);
+
+    namedVariable(className, false);
+    emitByte(OP_INHERIT);
+    classCompiler.hasSuperclass = true;
+  }
+
+  namedVariable(className, false);
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    method();
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(OP_POP);
+
+  if (classCompiler.hasSuperclass) {
+    endScope();
+  }
+  currentClass = currentClass->enclosing;
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
+  int global = parseVariable("Expect function name.");
   markInitialized();
-  function(TYPE_FUNCTION);
+  if (!takeUnit()) {
+    function(TYPE_FUNCTION);
+  }
   defineVariable(global);
 }
 
 static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.");
+  int global = parseVariable("Expect variable name.");
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -775,8 +1137,9 @@ static void ifStatement() {
 
   if (match(TOKEN_ELSE)) {
     statement();
-    patchJump(elseJump);
   }
+  /* Patch even without an else branch, the jump still has to land past the POP above. */
+  patchJump(elseJump);
 }
 
 static void forStatement() {
@@ -848,6 +1211,9 @@ static void returnStatement() {
   if (match(TOKEN_SEMICOLON)) {
     emitReturn();
   } else {
+    if (current->type == TYPE_INITIALIZER) {
+      error("Can't return a value from an initializer.");
+    }
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
     emitByte(OP_RETURN);
@@ -900,7 +1266,9 @@ static void synchronize() {
 }
 
 static void declaration() {
-  if (match(TOKEN_FUN)) {
+  if (match(TOKEN_CLASS)) {
+    classDeclaration();
+  } else if (match(TOKEN_FUN)) {
     funDeclaration();
   } else if (match(TOKEN_VAR)) {
     varDeclaration();
@@ -936,9 +1304,177 @@ static void statement() {
   }
 }
 
+#ifdef COMPILE_IN_PARALLEL
+/* A worker of a parallel compile. It owns a VM of its own, so its heap, intern table and
+front end state are all private, and the units it compiles stay there until compile() adopts
+them. */
+typedef struct {
+  pthread_t   thread;
+  VM          vm;
+  const char  *source;
+  size_t      length;
+  Unit        *units;
+  int         unitCount;
+  atomic_int  *nextUnit;  // Shared by the workers, the next unit nobody has taken yet.
+} Worker;
+
+/* Find the function declarations at the top level of the script, the ones outside of any
+brace or parenthesis. A declaration that does not end where it should is simply left out, the
+main compile reports whatever is wrong with it. */
+static Unit* findUnits(const char *source, size_t length, int *count) {
+  Unit *units = NULL;
+  int capacity = 0;
+  *count = 0;
+  int braces = 0;
+  int parens = 0;
+  TokenType previous = TOKEN_EOF;
+  Unit candidate;
+  candidate.name = NULL;
+
+  initScanner(source, length);
+  for (Token token = scanToken(); token.type != TOKEN_EOF; previous = token.type, token = scanToken()) {
+    switch (token.type) {
+      case TOKEN_IDENTIFIER:
+        if (previous == TOKEN_FUN && braces == 0 && parens == 0) {
+          candidate.name = token.start;
+          candidate.line = token.line;
+        }
+        break;
+      case TOKEN_LEFT_PAREN:  parens++; break;
+      case TOKEN_RIGHT_PAREN: parens = parens > 0 ? parens - 1 : 0; break;
+      case TOKEN_LEFT_BRACE:  braces++; break;
+      case TOKEN_RIGHT_BRACE:
+        braces = braces > 0 ? braces - 1 : 0;
+        if (braces == 0 && candidate.name != NULL) {
+          if (*count == capacity) {
+            capacity = capacity < 64 ? 64 : capacity * 2;
+            Unit *grown = (Unit*)realloc(units, sizeof(Unit) * capacity);
+            if (grown == NULL) break;
+            units = grown;
+          }
+          candidate.close = token;
+          candidate.function = NULL;
+          units[(*count)++] = candidate;
+          candidate.name = NULL;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  return units;
+}
+
+/* Compile the unit's function on its own, starting at its name. Only a body that compiles
+cleanly and ends exactly at the brace that the pre-scan found is any use to compile(). */
+static ObjFunction* compileUnit(Worker *worker, Unit *unit) {
+  initScanner(worker->source, worker->length);
+  seekScanner(unit->name, unit->line);
+  parser.hadError = false;
+  parser.panicMode = false;
+  current = NULL;
+  advance();
+  advance();
+
+  Compiler compiler;
+  ObjFunction *function = functionBody(&compiler, TYPE_FUNCTION);
+  FREE_ARRAY(parser.vm, Upvalue, compiler.upvalues, compiler.upvalueCapacity);
+  if (parser.hadError || parser.previous.start != unit->close.start || function->upvalueCount != 0) {
+    return NULL;
+  }
+  return function;
+}
+
+static void* runWorker(void *argument) {
+  Worker *worker = (Worker*)argument;
+  initVM(&worker->vm);
+  parser.vm = &worker->vm;
+  parser.silent = true;
+  parser.unitCount = 0;
+
+  for (;;) {
+    int index = atomic_fetch_add(worker->nextUnit, 1);
+    if (index >= worker->unitCount) break;
+    Unit *unit = &worker->units[index];
+    unit->function = compileUnit(worker, unit);
+    if (unit->function != NULL) {
+      /* Keep it alive in the worker's heap until compile() has copied it. */
+      push(&worker->vm, OBJ_VAL(unit->function));
+    }
+  }
+  parser.vm = NULL;
+  return NULL;
+}
+
+/* Compile the top-level functions of a long script on worker threads, ahead of the main
+compile, which then only copies them into its VM. Returns the workers to free once that is
+done, their VMs hold the compiled units. */
+static Worker* compileInParallel(const char *source, size_t length, int *workerCount) {
+  *workerCount = 0;
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  if (length < PARALLEL_COMPILE_MIN_LENGTH || processors < 2) {
+    return NULL;
+  }
+  int unitCount;
+  Unit *units = findUnits(source, length, &unitCount);
+  int threads = processors < unitCount ? (int)processors : unitCount;
+  if (threads > PARALLEL_COMPILE_MAX_THREADS) {
+    threads = PARALLEL_COMPILE_MAX_THREADS;
+  }
+  Worker *workers = threads >= 2 ? (Worker*)malloc(sizeof(Worker) * threads) : NULL;
+  if (workers == NULL) {
+    free(units);
+    return NULL;
+  }
+
+  atomic_int nextUnit;
+  atomic_init(&nextUnit, 0);
+  for (int i = 0; i < threads; i++) {
+    Worker *worker = &workers[*workerCount];
+    worker->source = source;
+    worker->length = length;
+    worker->units = units;
+    worker->unitCount = unitCount;
+    worker->nextUnit = &nextUnit;
+    if (pthread_create(&worker->thread, NULL, runWorker, worker) == 0) {
+      (*workerCount)++;
+    }
+  }
+  for (int i = 0; i < *workerCount; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  /* Without a single worker every unit is still NULL, and compile() compiles them itself. */
+  parser.units = units;
+  parser.unitCount = unitCount;
+  return workers;
+}
+
+static void freeWorkers(Worker *workers, int workerCount) {
+  for (int i = 0; i < workerCount; i++) {
+    freeVM(&workers[i].vm);
+  }
+  free(workers);
+  free(parser.units);
+  parser.units = NULL;
+  parser.unitCount = 0;
+}
+#endif
+
 /* This is an entrypoint for compilation; retruns true if no errors were encountered at compilation time, otherwise - false. */
-ObjFunction* compile(const char *source) {
-  initScanner(source);                              // A call back to initialize scanner.
+ObjFunction* compile(VM *vm, const char *source, size_t length) {
+  parser.units = NULL;
+  parser.unitCount = 0;
+  parser.nextUnit = 0;
+#ifdef COMPILE_IN_PARALLEL
+  int workerCount;
+  Worker *workers = compileInParallel(source, length, &workerCount);
+#endif
+
+  parser.vm = vm;
+  parser.silent = false;
+  currentClass = NULL;
+  initScanner(source, length);                              // A call back to initialize scanner.
 
   /* Initialize the compiler */
   Compiler compiler;
@@ -955,5 +1491,17 @@ ObjFunction* compile(const char *source) {
   }
 
   ObjFunction* function = endCompiler();
+#ifdef COMPILE_IN_PARALLEL
+  freeWorkers(workers, workerCount);
+#endif
   return parser.hadError ? NULL : function;
 }
+
+void markCompilerRoots(VM *vm) {
+  if (parser.vm != vm) return;  // This thread is compiling for another instance, if at all.
+  Compiler *compiler = current;
+  while (compiler != NULL) {
+    markObject(vm, (Obj*)compiler->function);
+    compiler = compiler->enclosing;
+  }
+}
@@ -6,7 +6,11 @@
 #include "chunk.h"
 #include "object.h"
 
-/* Parse a source code and output a compiled bytecode instructions to the chunk. */
-ObjFunction* compile(const char *source);
+/* Parse a source code of the given length and output a compiled bytecode instructions to the chunk.
+The source needs no NUL terminator. */
+ObjFunction* compile(VM *vm, const char *source, size_t length);
+
+/* Mark the functions that are still being compiled, the garbage collector can run mid-compilation. */
+void markCompilerRoots(VM *vm);
 
 #endif
@@ -6,6 +6,90 @@
 #include "value.h"
 #include "debug.h"
 
+/* Printable opcode names, indexed by OpCode. Shared with the profiler report. */
+static const char *opcodeNames[OP_COUNT] = {
+  [OP_CONSTANT] = "OP_CONSTANT",
+  [OP_NIL] = "OP_NIL",
+  [OP_TRUE] = "OP_TRUE",
+  [OP_FALSE] = "OP_FALSE",
+  [OP_POP] = "OP_POP",
+  [OP_GET_LOCAL] = "OP_GET_LOCAL",
+  [OP_SET_LOCAL] = "OP_SET_LOCAL",
+  [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+  [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+  [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+  [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+  [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+  [OP_EQUAL] = "OP_EQUAL",
+  [OP_GREATER] = "OP_GREATER",
+  [OP_LESS] = "OP_LESS",
+  [OP_ADD] = "OP_ADD",
+  [OP_SUBTRACT] = "OP_SUBTRACT",
+  [OP_MULTIPLY] = "OP_MULTIPLY",
+  [OP_DIVIDE] = "OP_DIVIDE",
+  [OP_NOT] = "OP_NOT",
+  [OP_NEGATE] = "OP_NEGATE",
+  [OP_PRINT] = "OP_PRINT",
+  [OP_JUMP] = "OP_JUMP",
+  [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+  [OP_LOOP] = "OP_LOOP",
+  [OP_CALL] = "OP_CALL",
+  [OP_CLOSURE] = "OP_CLOSURE",
+  [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+  [OP_RETURN] = "OP_RETURN",
+  [OP_NEW_LIST] = "OP_NEW_LIST",
+  [OP_LIST_APPEND] = "OP_LIST_APPEND",
+  [OP_INDEX_GET] = "OP_INDEX_GET",
+  [OP_INDEX_SET] = "OP_INDEX_SET",
+  [OP_CLASS] = "OP_CLASS",
+  [OP_INHERIT] = "OP_INHERIT",
+  [OP_METHOD] = "OP_METHOD",
+  [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+  [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+  [OP_INVOKE] = "OP_INVOKE",
+  [OP_GET_SUPER] = "OP_GET_SUPER",
+  [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+  [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+  [OP_GET_LOCAL_LONG] = "OP_GET_LOCAL_LONG",
+  [OP_SET_LOCAL_LONG] = "OP_SET_LOCAL_LONG",
+  [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+  [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+  [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+  [OP_GET_UPVALUE_LONG] = "OP_GET_UPVALUE_LONG",
+  [OP_SET_UPVALUE_LONG] = "OP_SET_UPVALUE_LONG",
+  [OP_CLOSURE_LONG] = "OP_CLOSURE_LONG",
+  [OP_CLASS_LONG] = "OP_CLASS_LONG",
+  [OP_METHOD_LONG] = "OP_METHOD_LONG",
+  [OP_GET_PROPERTY_LONG] = "OP_GET_PROPERTY_LONG",
+  [OP_SET_PROPERTY_LONG] = "OP_SET_PROPERTY_LONG",
+  [OP_INVOKE_LONG] = "OP_INVOKE_LONG",
+  [OP_GET_SUPER_LONG] = "OP_GET_SUPER_LONG",
+  [OP_SUPER_INVOKE_LONG] = "OP_SUPER_INVOKE_LONG",
+  [OP_ADD_LOCAL_CONST] = "OP_ADD_LOCAL_CONST",
+  [OP_INC_LOCAL] = "OP_INC_LOCAL",
+  [OP_LESS_LOCALS_JUMP] = "OP_LESS_LOCALS_JUMP",
+  [OP_MOVE] = "OP_MOVE",
+  [OP_LOADK] = "OP_LOADK",
+  [OP_ADD_RR] = "OP_ADD_RR",
+  [OP_SUBTRACT_RR] = "OP_SUBTRACT_RR",
+  [OP_MULTIPLY_RR] = "OP_MULTIPLY_RR",
+  [OP_DIVIDE_RR] = "OP_DIVIDE_RR",
+  [OP_ADD_RK] = "OP_ADD_RK",
+  [OP_SUBTRACT_RK] = "OP_SUBTRACT_RK",
+  [OP_MULTIPLY_RK] = "OP_MULTIPLY_RK",
+  [OP_DIVIDE_RK] = "OP_DIVIDE_RK",
+  [OP_EQUAL_NUM] = "OP_EQUAL_NUM",
+  [OP_ADD_NUM] = "OP_ADD_NUM",
+  [OP_ADD_STR] = "OP_ADD_STR",
+};
+
+const char* opcodeName(uint8_t instruction) {
+  if (instruction >= OP_COUNT || opcodeNames[instruction] == NULL) {
+    return NULL;
+  }
+  return opcodeNames[instruction];
+}
+
 static int simpleInstruction(const char *name, int offset) {
   printf("%s\n", name);
   return offset + 1; // simple, update offset by 1 byte
@@ -19,6 +103,71 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2; 
 }
 
+/* The 24-bit operand of a long instruction form, at the given offset. */
+static int readLong(Chunk *chunk, int offset) {
+  return (chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+}
+
+/* Like byteInstruction(), for the long forms: a slot or upvalue index. */
+static int longInstruction(const char *name, Chunk *chunk, int offset) {
+  printf("%-16s %4d\n", name, readLong(chunk, offset + 1));
+  return offset + 4;
+}
+
+/* Like constantInstruction(), for the long forms. */
+static int constantLongInstruction(const char *name, Chunk *chunk, int offset) {
+  int constant = readLong(chunk, offset + 1);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+/* A property instruction, short or long: its cache index and the name of the property. A call
+through the cache is followed by the argument count. */
+static int propertyInstruction(const char *name, Chunk *chunk, int offset, bool isLong, bool isCall) {
+  int cache = isLong ? readLong(chunk, offset + 1) : chunk->code[offset + 1];
+  offset += isLong ? 4 : 2;
+  printf("%-16s %4d '", name, cache);
+  printValue(chunk->constants.values[chunk->propertyCaches[cache].name]);
+  printf("'");
+  if (isCall) {
+    printf(" (%d args)", chunk->code[offset++]);
+  }
+  printf("\n");
+  return offset;
+}
+
+/* OP_SUPER_INVOKE and its long form: a method name constant, then the argument count. */
+static int invokeInstruction(const char *name, Chunk *chunk, int offset, bool isLong) {
+  int constant = isLong ? readLong(chunk, offset + 1) : chunk->code[offset + 1];
+  offset += isLong ? 4 : 2;
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (%d args)\n", chunk->code[offset]);
+  return offset + 1;
+}
+
+/* OP_CLOSURE and OP_CLOSURE_LONG, whose function constant starts at offset and is followed by
+one descriptor per upvalue. */
+static int closureInstruction(const char *name, Chunk *chunk, int offset, int constant) {
+  printf("%-16s %4d ", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("\n");
+  ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+  for (int j = 0; j < function->upvalueCount; j++) {
+    int start = offset;
+    uint8_t flags = chunk->code[offset++];
+    int index = chunk->code[offset++];
+    if (flags & UPVALUE_LONG) {
+      index = readLong(chunk, offset - 1);
+      offset += 2;
+    }
+    printf("%04d      |                     %s %d\n", start, (flags & UPVALUE_LOCAL) ? "local" : "upvalue", index);
+  }
+  return offset;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
   jump |= chunk->code[offset + 2];
@@ -26,6 +175,47 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
   return offset + 3;
 }
 
+/* A slot followed by a constant, as in OP_ADD_LOCAL_CONST. */
+static int localConstantInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+/* Two slots followed by a forward jump, as in OP_LESS_LOCALS_JUMP. */
+static int localsJumpInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t a = chunk->code[offset + 1];
+  uint8_t b = chunk->code[offset + 2];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+  jump |= chunk->code[offset + 4];
+  printf("%-16s %4d %4d %4d -> %d\n", name, a, b, offset, offset + 5 + jump);
+  return offset + 5;
+}
+
+/* A register instruction naming only slots: a destination and one or two sources. */
+static int slotsInstruction(const char *name, Chunk *chunk, int offset, int count) {
+  printf("%-16s", name);
+  for (int i = 1; i <= count; i++) {
+    printf(" %4d", chunk->code[offset + i]);
+  }
+  printf("\n");
+  return offset + 1 + count;
+}
+
+/* A register instruction with a destination slot, a source slot and a constant. */
+static int slotsConstantInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t destination = chunk->code[offset + 1];
+  uint8_t source = chunk->code[offset + 2];
+  uint8_t constant = chunk->code[offset + 3];
+  printf("%-16s %4d %4d %4d '", name, destination, source, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
 void disassembleChunk(Chunk *chunk, const char *name) {
   // A header to identify the chunk being disassembled
   printf("== %s ==\n", name);
@@ -53,13 +243,14 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   // Offset of given instruction
   printf("%04d ", offset);
 
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     // Instruction originates from the same line of source code as previous one
     printf("   | ");
   }
   else {
     // Instruction belongs to different source code line
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
 
   // Read single byte from the bytecode at the given offset
@@ -69,75 +260,130 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   we call a little utility function to display it */
   switch (instruction) {
     case OP_CONSTANT:
-      return constantInstruction("OP_CONSTANT", chunk, offset);
+      return constantInstruction(opcodeName(OP_CONSTANT), chunk, offset);
     case OP_NIL:
-      return simpleInstruction("OP_NIL", offset);
+      return simpleInstruction(opcodeName(OP_NIL), offset);
     case OP_TRUE:
-      return simpleInstruction("OP_TRUE", offset);
+      return simpleInstruction(opcodeName(OP_TRUE), offset);
     case OP_FALSE:
-      return simpleInstruction("OP_FALSE", offset);
+      return simpleInstruction(opcodeName(OP_FALSE), offset);
     case OP_POP:
-      return simpleInstruction("OP_POP", offset);
+      return simpleInstruction(opcodeName(OP_POP), offset);
     case OP_GET_LOCAL:
-      return byteInstruction("OP_GET_LOCAL", chunk, offset);
+      return byteInstruction(opcodeName(OP_GET_LOCAL), chunk, offset);
     case OP_SET_LOCAL:
-      return byteInstruction("OP_SET_LOCAL", chunk, offset);
+      return byteInstruction(opcodeName(OP_SET_LOCAL), chunk, offset);
     case OP_GET_GLOBAL:
-      return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+      return constantInstruction(opcodeName(OP_GET_GLOBAL), chunk, offset);
     case OP_DEFINE_GLOBAL:
-      return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+      return constantInstruction(opcodeName(OP_DEFINE_GLOBAL), chunk, offset);
     case OP_SET_GLOBAL:
-      return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+      return constantInstruction(opcodeName(OP_SET_GLOBAL), chunk, offset);
     case OP_GET_UPVALUE:
-      return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+      return byteInstruction(opcodeName(OP_GET_UPVALUE), chunk, offset);
     case OP_SET_UPVALUE:
-      return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+      return byteInstruction(opcodeName(OP_SET_UPVALUE), chunk, offset);
     case OP_EQUAL:
-      return simpleInstruction("OP_EQUAL", offset);
+      return simpleInstruction(opcodeName(OP_EQUAL), offset);
     case OP_GREATER:
-      return simpleInstruction("OP_GREATER", offset);
+      return simpleInstruction(opcodeName(OP_GREATER), offset);
     case OP_LESS:
-      return simpleInstruction("OP_LESS", offset);
+      return simpleInstruction(opcodeName(OP_LESS), offset);
     case OP_ADD:
-      return simpleInstruction("OP_ADD", offset);
+      return simpleInstruction(opcodeName(OP_ADD), offset);
     case OP_SUBTRACT:
-      return simpleInstruction("OP_SUBTRACT", offset);
+      return simpleInstruction(opcodeName(OP_SUBTRACT), offset);
     case OP_MULTIPLY:
-      return simpleInstruction("OP_MULTIPLY", offset);
+      return simpleInstruction(opcodeName(OP_MULTIPLY), offset);
     case OP_DIVIDE:
-      return simpleInstruction("OP_DIVIDE", offset);
+      return simpleInstruction(opcodeName(OP_DIVIDE), offset);
     case OP_NOT:
-      return simpleInstruction("OP_NOT", offset);
+      return simpleInstruction(opcodeName(OP_NOT), offset);
     case OP_NEGATE:
-      return simpleInstruction("OP_NEGATE", offset);
+      return simpleInstruction(opcodeName(OP_NEGATE), offset);
     case OP_PRINT:
-      return simpleInstruction("OP_PRINT", offset);
+      return simpleInstruction(opcodeName(OP_PRINT), offset);
     case OP_JUMP:
-      return jumpInstruction("OP_JUMP", 1, chunk, offset);
+      return jumpInstruction(opcodeName(OP_JUMP), 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
-      return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+      return jumpInstruction(opcodeName(OP_JUMP_IF_FALSE), 1, chunk, offset);
     case OP_LOOP:
-      return jumpInstruction("OP_LOOP", -1, chunk, offset);
+      return jumpInstruction(opcodeName(OP_LOOP), -1, chunk, offset);
     case OP_CALL:
-      return byteInstruction("OP_CALL", chunk, offset);
-    case OP_CLOSURE: {
-      offset++;
-      uint8_t constant = chunk->code[offset++];
-      printf("%-16s %4d ", "OP_CLOSURE", constant);
-      printValue(chunk->constants.values[constant]);
-      printf("\n");
-      ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
-      for (int j = 0; j < function->upvalueCount; j++) {
-        int isLocal = chunk->code[offset++];
-        int index = chunk->code[offset++];
-        printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
-      }
-      return offset;
-    }
+      return byteInstruction(opcodeName(OP_CALL), chunk, offset);
+    case OP_CLOSURE:
+      return closureInstruction(opcodeName(OP_CLOSURE), chunk, offset + 2, chunk->code[offset + 1]);
     case OP_CLOSE_UPVALUE:
-      return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+      return simpleInstruction(opcodeName(OP_CLOSE_UPVALUE), offset);
     case OP_RETURN:
-      return simpleInstruction("OP_RETURN", offset);
+      return simpleInstruction(opcodeName(OP_RETURN), offset);
+    case OP_NEW_LIST:
+      return simpleInstruction(opcodeName(OP_NEW_LIST), offset);
+    case OP_LIST_APPEND:
+      return simpleInstruction(opcodeName(OP_LIST_APPEND), offset);
+    case OP_INDEX_GET:
+      return simpleInstruction(opcodeName(OP_INDEX_GET), offset);
+    case OP_INDEX_SET:
+      return simpleInstruction(opcodeName(OP_INDEX_SET), offset);
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+      return constantInstruction(opcodeName(instruction), chunk, offset);
+    case OP_INHERIT:
+      return simpleInstruction(opcodeName(OP_INHERIT), offset);
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      return propertyInstruction(opcodeName(instruction), chunk, offset, false, false);
+    case OP_INVOKE:
+      return propertyInstruction(opcodeName(OP_INVOKE), chunk, offset, false, true);
+    case OP_SUPER_INVOKE:
+      return invokeInstruction(opcodeName(OP_SUPER_INVOKE), chunk, offset, false);
+    case OP_CONSTANT_LONG:
+    case OP_CLASS_LONG:
+    case OP_METHOD_LONG:
+    case OP_GET_SUPER_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+      return constantLongInstruction(opcodeName(instruction), chunk, offset);
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_GET_UPVALUE_LONG:
+    case OP_SET_UPVALUE_LONG:
+      return longInstruction(opcodeName(instruction), chunk, offset);
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY_LONG:
+      return propertyInstruction(opcodeName(instruction), chunk, offset, true, false);
+    case OP_INVOKE_LONG:
+      return propertyInstruction(opcodeName(OP_INVOKE_LONG), chunk, offset, true, true);
+    case OP_SUPER_INVOKE_LONG:
+      return invokeInstruction(opcodeName(OP_SUPER_INVOKE_LONG), chunk, offset, true);
+    case OP_CLOSURE_LONG:
+      return closureInstruction(opcodeName(OP_CLOSURE_LONG), chunk, offset + 4, readLong(chunk, offset + 1));
+    case OP_ADD_LOCAL_CONST:
+      return localConstantInstruction(opcodeName(OP_ADD_LOCAL_CONST), chunk, offset);
+    case OP_INC_LOCAL:
+      return localConstantInstruction(opcodeName(OP_INC_LOCAL), chunk, offset);
+    case OP_LESS_LOCALS_JUMP:
+      return localsJumpInstruction(opcodeName(OP_LESS_LOCALS_JUMP), chunk, offset);
+    case OP_MOVE:
+      return slotsInstruction(opcodeName(OP_MOVE), chunk, offset, 2);
+    case OP_LOADK:
+      return localConstantInstruction(opcodeName(OP_LOADK), chunk, offset);
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR:
+      return slotsInstruction(opcodeName(instruction), chunk, offset, 3);
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK:
+      return slotsConstantInstruction(opcodeName(instruction), chunk, offset);
+    case OP_EQUAL_NUM:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+      return simpleInstruction(opcodeName(instruction), offset);
     default:
       // Handler if a given byte is not an instruction
       printf("Unknown opcode %d\n", instruction);
@@ -12,4 +12,7 @@ void disassembleChunk(Chunk *chunk, const char *name);
 Returns the offset of the next instruction. */
 int disassembleInstruction(Chunk *chunk, int offset);
 
+/* The printable name of an opcode, NULL if the byte is not an opcode. */
+const char* opcodeName(uint8_t instruction);
+
 #endif
@@ -2,78 +2,140 @@
 #include "chunk.h"
 #include "debug.h"
 #include "vm.h"
+#include "compiler.h"
+#include "serializer.h"
+#include "source.h"
 
+/* Initial size of the REPL line buffer, it grows for longer lines. */
 #define REPL_BUFFER_LENGTH 1024
 
 static void ioOperationError(const char *message, const char *path);
-static void repl();
-static void *readFile(const char *path);
-static void runFile(const char *path);
+static bool readLine(char **line, size_t *capacity);
+static void repl(VM *vm);
+static void openFile(Source *source, const char *path);
+static InterpretResult runFile(VM *vm, const char *path);
 
 static void ioOperationError(const char *message, const char *path) {
   fprintf(stderr, message, path);
   exit(74);
 }
 
-static void repl() {
-  char line[REPL_BUFFER_LENGTH];
+/* Read a line of any length into the buffer, growing it as needed. Returns false at the end of
+the input. */
+static bool readLine(char **line, size_t *capacity) {
+  size_t length = 0;
+  for (;;) {
+    if (*capacity - length < 2) {
+      size_t grown = *capacity < REPL_BUFFER_LENGTH ? REPL_BUFFER_LENGTH : *capacity * 2;
+      char *buffer = (char*)realloc(*line, grown);
+      if (buffer == NULL) {
+        fprintf(stderr, "Not enough memory for the input line.\n");
+        exit(74);
+      }
+      *line = buffer;
+      *capacity = grown;
+    }
+    if (!fgets(*line + length, (int)(*capacity - length), stdin)) {
+      return length > 0;
+    }
+    length += strlen(*line + length);
+    if ((*line)[length - 1] == '\n') {
+      return true;
+    }
+  }
+}
+
+/* Every line runs in the same VM, so it sees the globals left by the lines and files before it.
+The buffer is kept from one line to the next. */
+static void repl(VM *vm) {
+  char *line = NULL;
+  size_t capacity = 0;
   for (;;) {
     printf("> ");
 
-    if (!fgets(line, sizeof(line), stdin)) {
+    if (!readLine(&line, &capacity)) {
       printf("\n");
       break;
     }
     // A scan-compile-execute pipeline entrypoint
-    interpret(line);
+    interpret(vm, line);
   }
+  free(line);
 }
 
-static void *readFile(const char *path) {
-  FILE *file = fopen(path, "rb");
-  if (file == NULL) {
-    ioOperationError("Could not open file \"%s\".\n", path);
+static void openFile(Source *source, const char *path) {
+  switch (openSource(source, path)) {
+    case SOURCE_OK:           return;
+    case SOURCE_CANNOT_OPEN:  ioOperationError("Could not open file \"%s\".\n", path); break;
+    case SOURCE_NO_MEMORY:    ioOperationError("Not enough memory to read \"%s\".\n", path); break;
+    case SOURCE_CANNOT_READ:  ioOperationError("Unable to read file \"%s\".\n", path); break;
   }
-  // Move pointer to the EOF to determine the file size, then rewind it back.
-  fseek(file, 0L, SEEK_END);
-  size_t fileSize = ftell(file);
-  rewind(file);
+}
 
-  char *buffer = (char *)malloc(fileSize + 1);
-  if (buffer == NULL) {
-    ioOperationError("Not enough memory to read \"%s\".\n", path);
-  }
+/* Load the script from its bytecode cache ("<path>c") when that was compiled from the same
+source, otherwise compile it and refresh the cache for the next run. */
+static InterpretResult runFile(VM *vm, const char *path) {
+  Source source;
+  openFile(&source, path);
+  uint64_t sourceHash = hashSource(source.chars, source.length);
 
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {
-    ioOperationError("Unable to read file \"%s\".\n", path);
+  size_t pathLength = strlen(path);
+  char *cachePath = (char *)malloc(pathLength + 2);
+  if (cachePath == NULL) {
+    ioOperationError("Not enough memory to run \"%s\".\n", path);
   }
-  buffer[bytesRead] = '\0';
+  memcpy(cachePath, path, pathLength);
+  cachePath[pathLength] = 'c';
+  cachePath[pathLength + 1] = '\0';
 
-  fclose(file);
-  return buffer;
-}
+  ObjFunction *function = readBytecode(vm, sourceHash, cachePath);
+  if (function == NULL) {
+    function = compile(vm, source.chars, source.length);
+    // Best effort, a read-only directory simply means no cache.
+    if (function != NULL) {
+      writeBytecode(function, sourceHash, cachePath);
+    }
+  }
+  free(cachePath);
+  closeSource(&source);
 
-static void runFile(const char *path) {
-  char *source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source);
-  if (result == INTERPRET_COMPILE_ERROR) { exit(65); }
-  if (result == INTERPRET_RUNTIME_ERROR) { exit(70); }
+  return function != NULL ? interpretFunction(vm, function) : INTERPRET_COMPILE_ERROR;
 }
 
 int main(int argc, char *argv[]) {
-  initVM();
+  bool profile = argc > 1 && strcmp(argv[1], "--profile") == 0;
+  if (profile) {
+    argc--;
+    argv++;
+  }
+  bool interactive = argc > 1 && strcmp(argv[argc - 1], "-") == 0;
+  if (interactive) {
+    argc--;
+  }
 
-  if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
-  } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+  VM vm;
+  initVM(&vm);
+  if (profile) {
+#ifdef VM_PROFILER
+    vm.profiler.enabled = true;
+#else
+    fprintf(stderr, "This build has no profiler, configure with -DPROFILER=ON.\n");
+#endif
   }
 
-  freeVM();
+  /* The files share the VM: the globals of each one are there for the ones after it, so the
+first files act as a prelude, compiled once and then loaded from their bytecode caches. */
+  InterpretResult result = INTERPRET_OK;
+  for (int i = 1; i < argc && result == INTERPRET_OK; i++) {
+    result = runFile(&vm, argv[i]);
+  }
+  if (result == INTERPRET_OK && (argc == 1 || interactive)) {
+    repl(&vm);
+  }
+
+  /* Shut the VM down before exiting, so that a profile is reported even after an error. */
+  freeVM(&vm);
+  if (result == INTERPRET_COMPILE_ERROR) { exit(65); }
+  if (result == INTERPRET_RUNTIME_ERROR) { exit(70); }
   return 0;
 }
@@ -1,7 +1,118 @@
 #include "memory.h"
 #include "object.h"
+#include "compiler.h"
 #include "vm.h"
 
+#ifdef DEBUG_LOG_GC
+  #include "debug.h"
+#endif
+
+void initAllocator(Allocator *allocator) {
+  for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+    allocator->freeLists[i] = NULL;
+  }
+  allocator->bump = NULL;
+  allocator->bumpEnd = NULL;
+  allocator->slabs = NULL;
+}
+
+void freeAllocator(Allocator *allocator) {
+  Slab *slab = allocator->slabs;
+  while (slab != NULL) {
+    Slab *next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  initAllocator(allocator);
+}
+
+static bool isPooled(size_t size) {
+#ifdef DEBUG_SYSTEM_ALLOCATOR
+  /* Every block comes from malloc, so memory checkers can see each of them. */
+  (void)size;
+  return false;
+#else
+  return size <= SLAB_MAX_SIZE;
+#endif
+}
+
+/* Index of the size class serving a block of the given (non-zero) size. */
+static int sizeClass(size_t size) {
+  return (int)((size - 1) / SLAB_GRANULARITY);
+}
+
+/* Get a block of the given size from the pool or from the system. */
+static void *allocateBlock(Allocator *allocator, size_t size) {
+  if (!isPooled(size)) {
+    void *block = malloc(size);
+    if (block == NULL) {
+      exit(1);
+    }
+    return block;
+  }
+
+  int index = sizeClass(size);
+  FreeCell *cell = allocator->freeLists[index];
+  if (cell != NULL) {
+    allocator->freeLists[index] = cell->next;
+    return cell;
+  }
+
+  size_t cellSize = (size_t)(index + 1) * SLAB_GRANULARITY;
+  if ((size_t)(allocator->bumpEnd - allocator->bump) < cellSize) {
+    /* Start a new slab. Its header takes one granule so that cells stay 16-byte aligned. */
+    Slab *slab = (Slab*)malloc(SLAB_SIZE);
+    if (slab == NULL) {
+      exit(1);
+    }
+    slab->next = allocator->slabs;
+    allocator->slabs = slab;
+    allocator->bump = (char*)slab + SLAB_GRANULARITY;
+    allocator->bumpEnd = (char*)slab + SLAB_SIZE;
+  }
+
+  void *block = allocator->bump;
+  allocator->bump += cellSize;
+  return block;
+}
+
+static void freeBlock(Allocator *allocator, void *pointer, size_t size) {
+  if (pointer == NULL) {
+    return;
+  }
+  if (!isPooled(size)) {
+    free(pointer);
+    return;
+  }
+
+  FreeCell *cell = (FreeCell*)pointer;
+  int index = sizeClass(size);
+  cell->next = allocator->freeLists[index];
+  allocator->freeLists[index] = cell;
+}
+
+/* Move a block to a new size, it is only copied when it changes size class or pool. */
+static void *resizeBlock(Allocator *allocator, void *pointer, size_t oldSize, size_t newSize) {
+  if (pointer == NULL) {
+    return allocateBlock(allocator, newSize);
+  }
+  if (!isPooled(oldSize) && !isPooled(newSize)) {
+    void *block = realloc(pointer, newSize);
+    if (block == NULL) {
+      exit(1);
+    }
+    return block;
+  }
+  if (isPooled(oldSize) && isPooled(newSize) && sizeClass(oldSize) == sizeClass(newSize)) {
+    return pointer;
+  }
+
+  void *block = allocateBlock(allocator, newSize);
+  memcpy(block, pointer, oldSize < newSize ? oldSize : newSize);
+  freeBlock(allocator, pointer, oldSize);
+  return block;
+}
+
 /* Dynamic memory management.
 oldSize   newSize               Operation
 
@@ -9,56 +120,355 @@ oldSize   newSize               Operation
 Non‑zero  0                     Free allocated block.
 Non‑zero  Smaller than oldSize  Shrink existing allocated block.
 Non‑zero  Larger than oldSize   Grow existing allocated block. */
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize) {
+  vm->bytesAllocated += newSize - oldSize;
+
+  /* Only allocations can trigger a collection, never frees. */
+  if (newSize > oldSize) {
+    vm->nurseryBytes += newSize - oldSize;
+    vm->totalBytesAllocated += newSize - oldSize;
+    if (vm->bytesAllocated > vm->peakBytesAllocated) {
+      vm->peakBytesAllocated = vm->bytesAllocated;
+    }
+#ifdef DEBUG_STRESS_GC
+    collectGarbage(vm);
+#else
+    if (vm->bytesAllocated > vm->nextGC || vm->nurseryBytes > GC_NURSERY_SIZE) {
+      collectGarbage(vm);
+    }
+#endif
+  }
+
   if (newSize == 0) {
-    free(pointer);
+    freeBlock(&vm->allocator, pointer, oldSize);
     return NULL;
   }
-  // If pointer parameter == NULL -> same as malloc(newSize)
-  void *new_array = realloc(pointer, newSize);
-  if (new_array == NULL) {
-    exit(1);
-  }
-  return new_array;
+  return resizeBlock(&vm->allocator, pointer, oldSize, newSize);
 }
 
-static void freeObject(Obj* object) {
+static void freeObject(VM *vm, Obj* object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
+  vm->objectCounts[object->type]--;
+
   // Detect the object type.
   switch (object->type) {
+    case OBJ_BOUND_METHOD:
+      FREE(vm, ObjBoundMethod, object);
+      break;
+    case OBJ_CLASS: {
+      ObjClass *klass = (ObjClass*)object;
+      freeTable(vm, &klass->methods);
+      FREE(vm, ObjClass, object);
+      break;
+    }
     case OBJ_CLOSURE: {
       ObjClosure *closure = (ObjClosure*)object;
-      FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-      FREE(ObjClosure, object);
+      FREE_ARRAY(vm, ObjUpvalue*, closure->upvalues, closure->upvalueCount);
+      FREE(vm, ObjClosure, object);
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction *function = (ObjFunction*)object;
-      freeChunk(&function->chunk);
-      FREE(ObjFunction, object);
+      freeChunk(vm, &function->chunk);
+      FREE(vm, ObjFunction, object);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance *instance = (ObjInstance*)object;
+      FREE_ARRAY(vm, Value, instance->fields, instance->capacity);
+      FREE(vm, ObjInstance, object);
+      break;
+    }
+    case OBJ_LIST: {
+      ObjList *list = (ObjList*)object;
+      freeValueArray(vm, &list->items);
+      FREE(vm, ObjList, object);
       break;
     }
     case OBJ_NATIVE:
-      FREE(ObjNative, object);
+      FREE(vm, ObjNative, object);
+      break;
+    case OBJ_SHAPE:
+      FREE(vm, ObjShape, object);
       break;
     case OBJ_STRING: {
       // If it is a string, assign a new pointer to that string and use to free up the memory.
       ObjString *string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1); // Type: char, ptr: string->chars, length: length + NULL.
-      FREE(ObjString, object); // Free up the memory allocated for "metadata".
+      if (string->chars != NULL) { // Unflattened ropes own no characters.
+        FREE_ARRAY(vm, char, string->chars, string->length + 1); // Type: char, ptr: string->chars, length: length + NULL.
+      }
+      FREE(vm, ObjString, object); // Free up the memory allocated for "metadata".
       break;
     }
     case OBJ_UPVALUE:
-      FREE(ObjUpvalue, object);
+      FREE(vm, ObjUpvalue, object);
       break;
   }
 }
 
-void freeObjects() {
-  Obj *object = vm.objects;
+/* Push an object to a growable array that lives outside of the managed heap. The collector
+must not recurse into reallocate() while it is running, so it uses the system allocator. */
+static void pushObjectArray(Obj ***array, int *count, int *capacity, Obj *object) {
+  if (*capacity < *count + 1) {
+    *capacity = GROW_CAPACITY(*capacity);
+    *array = (Obj**)realloc(*array, sizeof(Obj*) * *capacity);
+    if (*array == NULL) {
+      exit(1);
+    }
+  }
+  (*array)[(*count)++] = object;
+}
+
+void markObject(VM *vm, Obj *object) {
+  /* Old objects stay marked between collections, so a nursery collection stops at them. */
+  if (object == NULL || object->isMarked) {
+    return;
+  }
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void*)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+  object->isMarked = true;
+  pushObjectArray(&vm->grayStack, &vm->grayCount, &vm->grayCapacity, object);
+}
+
+void markValue(VM *vm, Value value) {
+  if (IS_OBJ(value)) {
+    markObject(vm, AS_OBJ(value));
+  }
+}
+
+void rememberObject(VM *vm, Obj *object) {
+  object->isRemembered = true;
+  pushObjectArray(&vm->remembered, &vm->rememberedCount, &vm->rememberedCapacity, object);
+}
+
+static void markArray(VM *vm, ValueArray *array) {
+  for (int i = 0; i < array->entries; i++) {
+    markValue(vm, array->values[i]);
+  }
+}
+
+/* Mark everything a gray object references, which turns it black. */
+static void blackenObject(VM *vm, Obj *object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p blacken ", (void*)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod *bound = (ObjBoundMethod*)object;
+      markValue(vm, bound->receiver);
+      markObject(vm, (Obj*)bound->method);
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass *klass = (ObjClass*)object;
+      markObject(vm, (Obj*)klass->name);
+      markTable(vm, &klass->methods);
+      markObject(vm, (Obj*)klass->shape);
+      markObject(vm, (Obj*)klass->initializer);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure *closure = (ObjClosure*)object;
+      markObject(vm, (Obj*)closure->function);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        markObject(vm, (Obj*)closure->upvalues[i]);
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction *function = (ObjFunction*)object;
+      markObject(vm, (Obj*)function->name);
+      markArray(vm, &function->chunk.constants);
+      /* A cached shape could otherwise be freed and its address reused by another shape. */
+      for (int i = 0; i < function->chunk.propertyCacheCount; i++) {
+        PropertyCacheEntry *entries = function->chunk.propertyCaches[i].entries;
+        for (int j = 0; j < PROPERTY_CACHE_WAYS; j++) {
+          markObject(vm, (Obj*)entries[j].shape);
+          markObject(vm, (Obj*)entries[j].transition);
+          markObject(vm, (Obj*)entries[j].method);
+        }
+      }
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance *instance = (ObjInstance*)object;
+      markObject(vm, (Obj*)instance->shape);
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        markValue(vm, instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_LIST:
+      markArray(vm, &((ObjList*)object)->items);
+      break;
+    case OBJ_UPVALUE:
+      markValue(vm, ((ObjUpvalue*)object)->closed);
+      break;
+    case OBJ_STRING: {
+      ObjString *string = (ObjString*)object;
+      markObject(vm, (Obj*)string->left);
+      markObject(vm, (Obj*)string->right);
+      break;
+    }
+    case OBJ_SHAPE: {
+      /* A shape keeps its whole class alive, and with it every other shape of the class. */
+      ObjShape *shape = (ObjShape*)object;
+      markObject(vm, (Obj*)shape->klass);
+      markObject(vm, (Obj*)shape->parent);
+      markObject(vm, (Obj*)shape->name);
+      markObject(vm, (Obj*)shape->children);
+      markObject(vm, (Obj*)shape->sibling);
+      break;
+    }
+    case OBJ_NATIVE:
+      break;
+  }
+}
+
+static void markRoots(VM *vm) {
+  for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+    markValue(vm, *slot);
+  }
+
+  for (int i = 0; i < vm->frameCount; i++) {
+    markObject(vm, (Obj*)vm->frames[i].closure);
+  }
+
+  for (int i = 0; vm->openUpvalueCount > 0 && i < vm->stackTop - vm->stack; i++) {
+    markObject(vm, (Obj*)vm->openUpvalues[i]);
+  }
+
+  for (CloxFunction *function = vm->hostFunctions; function != NULL; function = function->next) {
+    markObject(vm, (Obj*)function->closure);
+  }
+
+  markTable(vm, &vm->globals);
+  markCompilerRoots(vm);
+#ifdef VM_PROFILER
+  markProfilerRoots(vm);
+#endif
+}
+
+static void traceReferences(VM *vm) {
+  while (vm->grayCount > 0) {
+    Obj *object = vm->grayStack[--vm->grayCount];
+    blackenObject(vm, object);
+  }
+}
+
+/* Free every unmarked old object. Survivors keep their mark, which is what lets the next
+nursery collection treat the whole old generation as reachable. */
+static void sweepOld(VM *vm) {
+  Obj *previous = NULL;
+  Obj *object = vm->objects;
+  while (object != NULL) {
+    if (object->isMarked) {
+      previous = object;
+      object = object->next;
+    } else {
+      Obj *unreached = object;
+      object = object->next;
+      if (previous != NULL) {
+        previous->next = object;
+      } else {
+        vm->objects = object;
+      }
+      freeObject(vm, unreached);
+    }
+  }
+}
+
+/* Free the unmarked young objects and promote the survivors to the old generation. */
+static void sweepNursery(VM *vm) {
+  Obj *object = vm->nursery;
+  while (object != NULL) {
+    Obj *next = object->next;
+    if (object->isMarked) {
+      object->isOld = true;
+      object->next = vm->objects;
+      vm->objects = object;
+    } else {
+      freeObject(vm, object);
+    }
+    object = next;
+  }
+  vm->nursery = NULL;
+}
+
+void collectGarbage(VM *vm) {
+  /* Collect the whole heap once it outgrows the threshold, otherwise only the nursery. */
+  bool full = vm->bytesAllocated > vm->nextGC;
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin (%s)\n", full ? "full" : "nursery");
+  size_t before = vm->bytesAllocated;
+#endif
+
+  if (full) {
+    /* Old objects are normally considered live, a full collection has to prove it again. */
+    for (Obj *object = vm->objects; object != NULL; object = object->next) {
+      object->isMarked = false;
+    }
+  } else {
+    /* Old objects that were written to since the last collection may be the only thing
+    keeping some young objects alive, trace through them as if they were roots. */
+    for (int i = 0; i < vm->rememberedCount; i++) {
+      blackenObject(vm, vm->remembered[i]);
+    }
+  }
+
+  markRoots(vm);
+  traceReferences(vm);
+  /* Interned strings are weak references, drop the ones nothing else points to. */
+  tableRemoveWhite(&vm->strings);
+
+  /* Every surviving young object is about to be promoted, so nothing in the old generation
+  will point into the nursery. Forget the remembered set before the sweep frees any of it. */
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    vm->remembered[i]->isRemembered = false;
+  }
+  vm->rememberedCount = 0;
+
+  if (full) {
+    sweepOld(vm);
+  }
+  sweepNursery(vm);
+
+  vm->nurseryBytes = 0;
+  vm->collections++;
+  if (full) {
+    vm->fullCollections++;
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+  }
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+static void freeObjectList(VM *vm, Obj *object) {
   // Iterate through each object in the linked list and free the memory.
   while (object != NULL) {
     Obj *next = object->next;
-    freeObject(object);
+    freeObject(vm, object);
     object = next;
   }
 }
+
+void freeObjects(VM *vm) {
+  freeObjectList(vm, vm->objects);
+  freeObjectList(vm, vm->nursery);
+  vm->objects = NULL;
+  vm->nursery = NULL;
+
+  free(vm->grayStack);
+  free(vm->remembered);
+}
@@ -4,31 +4,96 @@
 #define clox_memory_h
 
 #include "common.h"
+#include "object.h"
 
 /* Allocate a memory block of given size and type. */
-#define ALLOCATE(type, count) \
-  (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+  (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
 /* Free the memory block pointed by a given pointer. */
-#define FREE(type, pointer) \
-  reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) \
+  reallocate(vm, pointer, sizeof(type), 0)
 
 /* Expand the capacity of a dynamic array. */
 #define GROW_CAPACITY(capacity) \
   ((capacity) < 8 ? 8 : (capacity) * 2)
 
 /* Resize the dynamic array. */
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-  (type *)reallocate(pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount) \
+  (type *)reallocate(vm, pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
 
 /* Free the memory allocated for the dynamic array. */
-#define FREE_ARRAY(type, pointer, oldCount) \
-  reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+  reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
+
+/* Record a store into an old object, so that young objects it now points to are found by
+a nursery collection without rescanning the old generation. Must follow every write of a
+reference into the fields of an object that may already be old. */
+#define WRITE_BARRIER(vm, object) \
+  do { \
+    Obj *barrierObject = (Obj*)(object); \
+    if (barrierObject->isOld && !barrierObject->isRemembered) { \
+      rememberObject(vm, barrierObject); \
+    } \
+  } while (false)
+
+/* Blocks up to SLAB_MAX_SIZE bytes are pooled in size classes SLAB_GRANULARITY bytes apart,
+larger ones go straight to the system allocator. */
+#define SLAB_GRANULARITY  16
+#define SLAB_MAX_SIZE     256
+#define SLAB_CLASS_COUNT  (SLAB_MAX_SIZE / SLAB_GRANULARITY)
+
+/* Size of the blocks requested from the system to carve small blocks from. */
+#define SLAB_SIZE         (64 * 1024)
+
+/* A released small block, threaded onto the free list of its size class. */
+typedef struct FreeCell {
+  struct FreeCell *next;
+} FreeCell;
+
+/* Header of a block obtained from the system, all slabs are chained for teardown. */
+typedef struct Slab {
+  struct Slab *next;
+} Slab;
+
+/* Size-class pool allocator behind reallocate(). Fresh cells are bump-allocated from the
+current slab; freed cells are recycled through per-class free lists. */
+typedef struct {
+  FreeCell  *freeLists[SLAB_CLASS_COUNT];
+  char      *bump;      // Next unused byte in the current slab.
+  char      *bumpEnd;   // End of the current slab.
+  Slab      *slabs;
+} Allocator;
+
+/* Heap size multiplier used to schedule the next full collection. */
+#define GC_HEAP_GROW_FACTOR 2
+
+/* Bytes allocated since the last collection that trigger a nursery collection. */
+#define GC_NURSERY_SIZE (256 * 1024)
 
 /* Dynamic memory management. See memory.c for more details. */
-void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize);
+
+/* Prepare an empty pool allocator. */
+void initAllocator(Allocator *allocator);
+
+/* Return every slab to the system. Blocks handed out by the allocator become invalid. */
+void freeAllocator(Allocator *allocator);
+
+/* Mark a heap object as reachable and queue it for tracing. */
+void markObject(VM *vm, Obj *object);
+
+/* Mark the object referenced by a Value, if any. */
+void markValue(VM *vm, Value value);
+
+/* Add an old object to the remembered set. Use WRITE_BARRIER() instead of calling it directly. */
+void rememberObject(VM *vm, Obj *object);
+
+/* Run a collection: a nursery collection when only the young generation has grown,
+a full mark-sweep of both generations once the heap reaches the next threshold. */
+void collectGarbage(VM *vm);
 
 /* Free the memory allocated for objects in a heap at the runtime. */
-void freeObjects();
+void freeObjects(VM *vm);
 
 #endif
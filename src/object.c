@@ -4,29 +4,70 @@
 #include "table.h"
 
 /* A wrapper for allocateObject() to avoid manual typecatsing and calculate the size. */
-#define ALLOCATE_OBJ(type, objectType) (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) (type*)allocateObject(vm, sizeof(type), objectType)
 
 /* Allocate object of a given size and type. */
-static Obj* allocateObject(size_t size, ObjType type) {
+static Obj* allocateObject(VM *vm, size_t size, ObjType type) {
   /* Create new "header" object and set its type. */
-  Obj *object = (Obj*)reallocate(NULL, 0, size);
+  Obj *object = (Obj*)reallocate(vm, NULL, 0, size);
   object->type = type;
+  object->isMarked = false;
+  object->isOld = false;
+  object->isRemembered = false;
+  vm->objectCounts[type]++;
 
-  /* Update pointers in the VM registers: next <= current, current <= new. */
-  object->next = vm.objects;
-  vm.objects = object;
+  /* New objects are born in the nursery: next <= current, current <= new. */
+  object->next = vm->nursery;
+  vm->nursery = object;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p allocate %zu for %d\n", (void*)object, size, type);
+#endif
 
   return object;
 }
 
-ObjClosure* newClosure(ObjFunction *function) {
+ObjBoundMethod* newBoundMethod(VM *vm, Value receiver, ObjClosure *method) {
+  ObjBoundMethod *bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
+  bound->receiver = receiver;
+  bound->method = method;
+  return bound;
+}
+
+static ObjShape* newShape(VM *vm, ObjClass *klass, ObjShape *parent, ObjString *name) {
+  ObjShape *shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+  shape->klass = klass;
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = parent != NULL ? parent->fieldCount + 1 : 0;
+  shape->children = NULL;
+  shape->sibling = NULL;
+  return shape;
+}
+
+ObjClass* newClass(VM *vm, ObjString *name) {
+  ObjClass *klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
+  klass->name = name;
+  initTable(&klass->methods);
+  klass->shape = NULL;
+  klass->initializer = NULL;
+  klass->fieldCapacity = 0;
+  /* Keep the class on the stack, allocating its empty shape may collect. */
+  push(vm, OBJ_VAL(klass));
+  klass->shape = newShape(vm, klass, NULL, NULL);
+  WRITE_BARRIER(vm, klass);
+  pop(vm);
+  return klass;
+}
+
+ObjClosure* newClosure(VM *vm, ObjFunction *function) {
   // Create a dynamic array to store upvalues and initilize its memory
-  ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+  ObjUpvalue **upvalues = ALLOCATE(vm, ObjUpvalue*, function->upvalueCount);
   for (int i = 0; i < function->upvalueCount; i++) {
     upvalues[i] = NULL;
   }
 
-  ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  ObjClosure *closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
 
   closure->function = function;
   closure->upvalues = upvalues;
@@ -36,8 +77,8 @@ ObjClosure* newClosure(ObjFunction *function) {
   return closure;
 }
 
-ObjFunction* newFunction() {
-  ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction* newFunction(VM *vm) {
+  ObjFunction *function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
   function->name = NULL;
@@ -45,21 +86,104 @@ ObjFunction* newFunction() {
   return function;
 }
 
-ObjNative* newNative(NativeFn function) {
-  ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjInstance* newInstance(VM *vm, ObjClass *klass) {
+  /* Reserve as many fields as the largest instance of the class so far, instances of a class
+  usually all get the same ones. */
+  int capacity = klass->fieldCapacity;
+  Value *fields = capacity > 0 ? ALLOCATE(vm, Value, capacity) : NULL;
+  ObjInstance *instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
+  instance->shape = klass->shape;
+  instance->fields = fields;
+  instance->capacity = capacity;
+  return instance;
+}
+
+int findField(ObjShape *shape, ObjString *name) {
+  /* Shapes compare field names by identity, so they must be interned whatever their length. */
+  assert(name->isInterned);
+  for (; shape->parent != NULL; shape = shape->parent) {
+    if (shape->name == name) {
+      return shape->fieldCount - 1;
+    }
+  }
+  return -1;
+}
+
+/* The child of the shape adding the named field, created on the first instance that needs it. */
+static ObjShape* shapeTransition(VM *vm, ObjShape *shape, ObjString *name) {
+  assert(name->isInterned);
+  for (ObjShape *child = shape->children; child != NULL; child = child->sibling) {
+    if (child->name == name) {
+      return child;
+    }
+  }
+  ObjShape *child = newShape(vm, shape->klass, shape, name);
+  child->sibling = shape->children;
+  shape->children = child;
+  WRITE_BARRIER(vm, shape);
+  return child;
+}
+
+void addField(VM *vm, ObjInstance *instance, ObjString *name, Value value) {
+  ObjShape *shape = shapeTransition(vm, instance->shape, name);
+  int slot = shape->fieldCount - 1;
+  if (slot == instance->capacity) {
+    int oldCapacity = instance->capacity;
+    instance->capacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+    instance->fields = GROW_ARRAY(vm, Value, instance->fields, oldCapacity, instance->capacity);
+  }
+  /* Store the value before the new shape makes the collector look at it. */
+  instance->fields[slot] = value;
+  instance->shape = shape;
+  WRITE_BARRIER(vm, instance);
+  if (shape->fieldCount > shape->klass->fieldCapacity) {
+    shape->klass->fieldCapacity = shape->fieldCount;
+  }
+}
+
+ObjNative* newNative(VM *vm, NativeFn function, int arity) {
+  ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->arity = arity;
   return native;
 }
 
-/* Create new object of type string by calling macro wrapper, initialize string object fields
-(a string length and a pointer to that string) and return the pointer to the string object. */
-static ObjString* allocateString(char *chars, int length, uint32_t hash) {
-  ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+ObjList* newList(VM *vm) {
+  ObjList *list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+  initValueArray(&list->items);
+  list->isPrinting = false;
+  return list;
+}
+
+void appendToList(VM *vm, ObjList *list, Value value) {
+  writeValueArray(vm, &list->items, value);
+  WRITE_BARRIER(vm, list);
+}
+
+/* Create new object of type string by calling macro wrapper and initialize string object fields
+(a string length and a pointer to that string). The hash is left for stringHash() to compute. */
+static ObjString* allocateFlatString(VM *vm, char *chars, int length) {
+  ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
   string->length = length;
   string->chars = chars;
+  string->hash = 0;
+  string->isHashed = false;
+  string->isInterned = false;
+  string->left = NULL;
+  string->right = NULL;
+  return string;
+}
+
+/* Allocate a string with a known hash and add it to the string table. */
+static ObjString* allocateString(VM *vm, char *chars, int length, uint32_t hash) {
+  ObjString *string = allocateFlatString(vm, chars, length);
   string->hash = hash;
-  /* Automatically intern every string. */
-  tableSet(&vm.strings, string, NIL_VAL);
+  string->isHashed = true;
+  string->isInterned = true;
+  /* Keep it on the stack, growing the table may collect. */
+  push(vm, OBJ_VAL(string));
+  tableSet(vm, &vm->strings, string, NIL_VAL);
+  pop(vm);
   return string;
 }
 
@@ -73,36 +197,113 @@ static uint32_t hashString(const char* key, int length) {
   return hash;
 }
 
-ObjString* takeString(char* chars, int length) {
+uint32_t stringHash(ObjString *string) {
+  if (!string->isHashed) {
+    string->hash = hashString(string->chars, string->length);
+    string->isHashed = true;
+  }
+  return string->hash;
+}
+
+ObjString* takeString(VM *vm, char* chars, int length) {
   uint32_t hash = hashString(chars, length);
   /* Look up the string in the string table first. If it is found, before returning it, 
   we must free the memory for the string that was passed in. */
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
+    FREE_ARRAY(vm, char, chars, length + 1);
     return interned;
   }
 
-  return allocateString(chars, length, hash);
+  return allocateString(vm, chars, length, hash);
+}
+
+ObjString* newString(VM *vm, char *chars, int length) {
+  return allocateFlatString(vm, chars, length);
 }
 
 /* Allocate new memory block on heap, copy given array of characters from lexeme to
 that memory block, append the terminating chararcter to the end and pass to the
 string object constructor function. */
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM *vm, const char* chars, int length) {
   uint32_t hash = hashString(chars, length);
   /* Look up a new string being created in the string table first. If it is found, 
   instead of “copying”, just return a reference to that string. */
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
   if (interned != NULL) {
     return interned;
   }
   /* Otherwise, allocate a new string, and store it in the string table. */
-  char *heapChars = ALLOCATE(char, length + 1);
+  char *heapChars = ALLOCATE(vm, char, length + 1);
+  memcpy(heapChars, chars, length);
+  heapChars[length] = '\0';
+
+  return allocateString(vm, heapChars, length, hash);
+}
+
+ObjString* copyLiteralString(VM *vm, const char *chars, int length) {
+  if (length <= INTERN_MAX_LENGTH) {
+    return copyString(vm, chars, length);
+  }
+  char *heapChars = ALLOCATE(vm, char, length + 1);
   memcpy(heapChars, chars, length);
   heapChars[length] = '\0';
+  return newString(vm, heapChars, length);
+}
 
-  return allocateString(heapChars, length, hash);
+ObjString* newRope(VM *vm, ObjString *left, ObjString *right) {
+  ObjString *rope = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
+  rope->length = left->length + right->length;
+  rope->chars = NULL;
+  rope->hash = 0;
+  rope->isHashed = false;
+  rope->isInterned = false;
+  rope->left = left;
+  rope->right = right;
+  return rope;
+}
+
+/* Copy the characters of a string into the buffer. Only the smaller half of a rope is visited
+recursively, the larger one is walked in a loop, so the depth stays logarithmic even for
+ropes built by appending one piece at a time. */
+static void copyChars(ObjString *string, char *buffer) {
+  while (string->chars == NULL) {
+    if (string->left->length <= string->right->length) {
+      copyChars(string->left, buffer);
+      buffer += string->left->length;
+      string = string->right;
+    } else {
+      copyChars(string->right, buffer + string->left->length);
+      string = string->left;
+    }
+  }
+  memcpy(buffer, string->chars, string->length);
+}
+
+void flattenString(VM *vm, ObjString *string) {
+  if (string->chars != NULL) return;
+
+  char *chars = ALLOCATE(vm, char, string->length + 1);
+  copyChars(string, chars);
+  chars[string->length] = '\0';
+  /* The children are only dropped now, the allocation above may have collected. */
+  string->chars = chars;
+  string->left = NULL;
+  string->right = NULL;
+}
+
+static void printString(ObjString *string) {
+  if (string->chars != NULL) {
+    printf("%s", string->chars);
+    return;
+  }
+  /* Printing has no VM to flatten with, the VM flattens before OP_PRINT. This path is only
+  taken by the debugging aids, so a temporary buffer is good enough. */
+  char *chars = (char*)malloc(string->length);
+  if (chars == NULL) return;
+  copyChars(string, chars);
+  fwrite(chars, 1, string->length, stdout);
+  free(chars);
 }
 
 static void printFunction(ObjFunction *function) {
@@ -113,28 +314,60 @@ static void printFunction(ObjFunction *function) {
   printf("<fn %s>", function->name->chars);
 }
 
-ObjUpvalue* newUpvalue(Value* slot) {
-  ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+static void printList(ObjList *list) {
+  /* A list may contain itself, print the inner occurrence as [...]. */
+  if (list->isPrinting) {
+    printf("[...]");
+    return;
+  }
+  list->isPrinting = true;
+  printf("[");
+  for (int i = 0; i < list->items.entries; i++) {
+    if (i > 0) {
+      printf(", ");
+    }
+    printValue(list->items.values[i]);
+  }
+  printf("]");
+  list->isPrinting = false;
+}
+
+ObjUpvalue* newUpvalue(VM *vm, Value* slot) {
+  ObjUpvalue *upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
   upvalue->closed = NIL_VAL;
   upvalue->location = slot;
-  upvalue->next = NULL;
 
   return upvalue;
 }
 
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
+    case OBJ_BOUND_METHOD:
+      printFunction(AS_BOUND_METHOD(value)->method->function);
+      break;
+    case OBJ_CLASS:
+      printf("%s", AS_CLASS(value)->name->chars);
+      break;
     case OBJ_CLOSURE:
       printFunction(AS_CLOSURE(value)->function);
       break;
     case OBJ_FUNCTION:
       printFunction(AS_FUNCTION(value));
       break;
+    case OBJ_INSTANCE:
+      printf("%s instance", AS_INSTANCE(value)->shape->klass->name->chars);
+      break;
+    case OBJ_LIST:
+      printList(AS_LIST(value));
+      break;
     case OBJ_NATIVE:
       printf("<native fn>");
       break;
+    case OBJ_SHAPE:
+      printf("shape");
+      break;
     case OBJ_STRING:
-      printf("%s", AS_CSTRING(value));
+      printString(AS_STRING(value));
       break;
     case OBJ_UPVALUE:
       printf("upvalue");
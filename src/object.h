@@ -4,20 +4,32 @@
 #include "common.h"
 #include "value.h"
 #include "chunk.h"
+#include "table.h"
 
 /* Object type enum. */
 typedef enum {
+  OBJ_BOUND_METHOD,
+  OBJ_CLASS,
   OBJ_CLOSURE,
   OBJ_FUNCTION,
+  OBJ_INSTANCE,
+  OBJ_LIST,
   OBJ_NATIVE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_UPVALUE,
 } ObjType;
 
+/* The number of object types, for arrays indexed by ObjType. */
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
 /* Object "header" struct shared by all obejcts types. */
 struct Obj {
   ObjType     type;
-  struct Obj  *next; // We store objects as a linked list.
+  bool        isMarked;     // Reached during the current collection. Old objects keep it set between collections.
+  bool        isOld;        // Survived a collection and was promoted out of the nursery.
+  bool        isRemembered; // Old object already recorded in the remembered set.
+  struct Obj  *next;        // We store objects as a linked list.
 };
 
 typedef struct {
@@ -28,45 +40,147 @@ typedef struct {
   ObjString *name;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+/* A native writes its return value to *result and returns true, or reports why it failed with
+nativeError() and returns false, which aborts the script like any other runtime error. The
+arguments and the result are VM stack slots, so they stay reachable while the native allocates. */
+typedef bool (*NativeFn)(VM *vm, int argCount, Value *args, Value *result);
+
+/* The arity of a native that checks its argument count itself. */
+#define NATIVE_VARIADIC -1
 
 typedef struct {
   Obj       obj;
   NativeFn  function;
+  int       arity;        // Checked by the VM before the call, unless NATIVE_VARIADIC.
 } ObjNative;
 
+/* A string is either flat, with its characters in chars, or a rope: the lazy concatenation
+of left and right, with chars still NULL. Ropes are flattened in place the first time their
+characters are needed, and let go of their children then. */
 struct ObjString {
-  Obj     obj;
-  int     length;
-  char    *chars;
-  uint32_t hash;
+  Obj               obj;
+  int               length;
+  char              *chars;
+  uint32_t          hash;       // Only valid once isHashed is set, see stringHash().
+  bool              isHashed;
+  bool              isInterned; // Stored in vm->strings, so equal interned strings are the same object.
+  struct ObjString  *left;
+  struct ObjString  *right;
 };
 
+/* String literals up to this long are interned along with every identifier. Longer literals
+and strings built at runtime are neither interned nor hashed up front. */
+#define INTERN_MAX_LENGTH 32
+
+/* Concatenations at least this long build a rope instead of copying both operands. */
+#define ROPE_MIN_LENGTH 64
+
+/* A list keeps its elements contiguously, appending grows the buffer geometrically. */
+typedef struct {
+  Obj         obj;
+  ValueArray  items;
+  bool        isPrinting;   // Set while printObject() is inside the list, to cut cycles short.
+} ObjList;
+
 typedef struct ObjUpvalue {
   Obj               obj;
-  Value             *location;
+  Value             *location;  // The stack slot while open, &closed once closed.
   Value             closed;
-  struct ObjUpvalue *next;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
   Obj         obj;
   ObjFunction *function;
   ObjUpvalue  **upvalues;
   int         upvalueCount;
 } ObjClosure;
 
-ObjClosure* newClosure(ObjFunction *function);
+typedef struct ObjShape ObjShape;
+
+typedef struct {
+  Obj         obj;
+  ObjString   *name;
+  Table       methods;
+  ObjShape    *shape;         // The empty shape every instance starts out with.
+  ObjClosure  *initializer;   // The init() method, NULL if the class has none.
+  int         fieldCapacity;  // Most fields an instance has had, new instances reserve that many.
+} ObjClass;
+
+/* A shape, or hidden class, is the layout of an instance: the names of its fields and where
+each one is stored. The shapes of a class form a tree rooted at the class's empty shape, each
+child adding one field to its parent. Instances that got the same fields in the same order
+end up with the same shape, which is what the property caches in chunk.h are keyed on. */
+struct ObjShape {
+  Obj         obj;
+  ObjClass    *klass;
+  ObjShape    *parent;        // NULL for the empty shape.
+  ObjString   *name;          // The field added to the parent, stored at index fieldCount - 1.
+  int         fieldCount;
+  ObjShape    *children;      // The shapes adding one more field, linked through sibling.
+  ObjShape    *sibling;
+};
+
+/* The fields are stored in the order of the instance's shape, which also knows its class. */
+typedef struct {
+  Obj         obj;
+  ObjShape    *shape;
+  Value       *fields;
+  int         capacity;
+} ObjInstance;
+
+typedef struct {
+  Obj         obj;
+  Value       receiver;
+  ObjClosure  *method;
+} ObjBoundMethod;
+
+ObjBoundMethod* newBoundMethod(VM *vm, Value receiver, ObjClosure *method);
+
+ObjClass* newClass(VM *vm, ObjString *name);
+
+ObjClosure* newClosure(VM *vm, ObjFunction *function);
+
+ObjFunction* newFunction(VM *vm);
+
+ObjInstance* newInstance(VM *vm, ObjClass *klass);
+
+/* The index of the named field in instances of the given shape, or -1 if they have no such
+field. Names are interned, so they are compared by identity. */
+int findField(ObjShape *shape, ObjString *name);
+
+/* Add a field the instance does not have yet, moving it to the next shape. The instance and
+the value must be reachable meanwhile, the new shape and the field storage are allocated. */
+void addField(VM *vm, ObjInstance *instance, ObjString *name, Value value);
+
+ObjNative* newNative(VM *vm, NativeFn function, int arity);
+
+ObjList* newList(VM *vm);
+
+/* Append a value to the list. The value must be reachable meanwhile, growing the list may collect. */
+void appendToList(VM *vm, ObjList *list, Value value);
+
+/* Copy the characters into an interned string, for identifiers and names. */
+ObjString* copyString(VM *vm, const char *chars, int length);
+
+/* Copy the characters of a string literal, interning it only if it is short. */
+ObjString* copyLiteralString(VM *vm, const char *chars, int length);
+
+ObjUpvalue* newUpvalue(VM *vm, Value *slot);
 
-ObjFunction* newFunction();
+/* Take ownership of the characters and intern them. */
+ObjString* takeString(VM *vm, char *chars, int length);
 
-ObjNative* newNative(NativeFn function);
+/* Take ownership of the characters without hashing or interning them. */
+ObjString* newString(VM *vm, char *chars, int length);
 
-ObjString* copyString(const char *chars, int length);
+/* The hash of a flat string, computed the first time it is asked for. */
+uint32_t stringHash(ObjString *string);
 
-ObjUpvalue* newUpvalue(Value *slot);
+/* Concatenate two strings without copying them. The result is not interned. */
+ObjString* newRope(VM *vm, ObjString *left, ObjString *right);
 
-ObjString* takeString(char *chars, int length);
+/* Give a rope its characters. It allocates, so the rope must be reachable from a root. */
+void flattenString(VM *vm, ObjString *string);
 
 void printObject(Value value);
 
@@ -76,15 +190,24 @@ static inline bool isObjType(Value value, ObjType type) {
 
 #define OBJ_TYPE(value)   (AS_OBJ(value)->type)
 
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_CLASS(value)     isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)   isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value)  isObjType(value, OBJ_FUNCTION)
+#define IS_INSTANCE(value)  isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value)      isObjType(value, OBJ_LIST)
 #define IS_NATIVE(value)    isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value)    isObjType(value, OBJ_STRING)
+#define IS_ROPE(value)      (IS_STRING(value) && AS_STRING(value)->chars == NULL)
 
 #define AS_STRING(value)    ((ObjString*)AS_OBJ(value))
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_CLASS(value)     ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)   ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value)  ((ObjFunction*)AS_OBJ(value))
-#define AS_NATIVE(value)    (((ObjNative*)AS_OBJ(value))->function)
+#define AS_INSTANCE(value)  ((ObjInstance*)AS_OBJ(value))
+#define AS_LIST(value)      ((ObjList*)AS_OBJ(value))
+#define AS_NATIVE(value)    ((ObjNative*)AS_OBJ(value))
 #define AS_CSTRING(value)   (((ObjString*)AS_OBJ(value))->chars)
 
 #endif
@@ -0,0 +1,583 @@
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+
+/* A decoded instruction. Rewrites happen in place at the original offset and may only make
+an instruction shorter, the chunk is compacted once the passes reach a fixed point. */
+typedef struct {
+  int     offset;       // Where the instruction starts in the original code.
+  int     length;       // Opcode plus operands, in bytes.
+  int     line;
+  int     target;       // Index of the destination instruction for jumps, -1 otherwise.
+  int     newOffset;    // Where the instruction lands in the compacted code.
+  bool    isTarget;     // Some live jump lands here.
+  bool    isDead;
+} Instruction;
+
+/* The optimizer registers. */
+typedef struct {
+  VM          *vm;
+  ObjFunction *function;
+  Chunk       *chunk;
+  Instruction *code;        // One entry per instruction, plus a sentinel for the end of the chunk.
+  int         count;        // Number of real instructions, the sentinel lives at code[count].
+} Optimizer;
+
+static uint8_t opcodeAt(Optimizer *optimizer, int index) {
+  return optimizer->chunk->code[optimizer->code[index].offset];
+}
+
+/* Every jump keeps its 16-bit offset in the last two bytes, relative to its own end. */
+static bool isJump(uint8_t instruction) {
+  return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP ||
+         instruction == OP_LESS_LOCALS_JUMP;
+}
+
+/* The size of the instruction at the given offset, including its operands. */
+static int instructionLength(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+      return 2;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      return 3;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_ADD_LOCAL_CONST:
+    case OP_INC_LOCAL:
+      return 3;
+    case OP_MOVE:
+    case OP_LOADK:
+      return 3;
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK:
+      return 4;
+    case OP_LESS_LOCALS_JUMP:
+      return 5;
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_UPVALUE_LONG:
+    case OP_SET_UPVALUE_LONG:
+    case OP_CLASS_LONG:
+    case OP_METHOD_LONG:
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY_LONG:
+    case OP_GET_SUPER_LONG:
+      return 4;
+    case OP_INVOKE_LONG:
+    case OP_SUPER_INVOKE_LONG:
+      return 5;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+      bool isLong = chunk->code[offset] == OP_CLOSURE_LONG;
+      int constant = isLong ? (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3]
+                            : chunk->code[offset + 1];
+      ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+      /* Each upvalue descriptor is a flags byte and a one or three byte index. */
+      int length = isLong ? 4 : 2;
+      for (int i = 0; i < function->upvalueCount; i++) {
+        length += (chunk->code[offset + length] & UPVALUE_LONG) ? 4 : 2;
+      }
+      return length;
+    }
+    default:
+      return 1;
+  }
+}
+
+static int jumpDestination(Chunk *chunk, int offset) {
+  int end = offset + instructionLength(chunk, offset);
+  uint16_t jump = (uint16_t)(chunk->code[end - 2] << 8);
+  jump |= chunk->code[end - 1];
+  return chunk->code[offset] == OP_LOOP ? end - jump : end + jump;
+}
+
+/* Split the chunk into instructions and turn jump offsets into instruction indices. */
+static void decode(Optimizer *optimizer) {
+  Chunk *chunk = optimizer->chunk;
+  optimizer->count = 0;
+  for (int offset = 0; offset < chunk->entries; offset += instructionLength(chunk, offset)) {
+    optimizer->count++;
+  }
+
+  optimizer->code = ALLOCATE(optimizer->vm, Instruction, optimizer->count + 1);
+  int *indexAt = ALLOCATE(optimizer->vm, int, chunk->entries + 1);
+
+  int offset = 0;
+  for (int i = 0; i <= optimizer->count; i++) {
+    Instruction *instruction = &optimizer->code[i];
+    bool isEnd = i == optimizer->count;
+    instruction->offset = offset;
+    instruction->length = isEnd ? 0 : instructionLength(chunk, offset);
+    instruction->line = isEnd ? 0 : getLine(chunk, offset);
+    instruction->target = -1;
+    instruction->isTarget = false;
+    instruction->isDead = false;
+    indexAt[offset] = i;
+    offset += instruction->length;
+  }
+
+  for (int i = 0; i < optimizer->count; i++) {
+    if (isJump(opcodeAt(optimizer, i))) {
+      optimizer->code[i].target = indexAt[jumpDestination(chunk, optimizer->code[i].offset)];
+    }
+  }
+  FREE_ARRAY(optimizer->vm, int, indexAt, chunk->entries + 1);
+}
+
+/* The first live instruction at or after the given index; the sentinel is never dead. */
+static int resolve(Optimizer *optimizer, int index) {
+  while (optimizer->code[index].isDead) {
+    index++;
+  }
+  return index;
+}
+
+static int nextLive(Optimizer *optimizer, int index) {
+  return index < optimizer->count ? resolve(optimizer, index + 1) : index;
+}
+
+/* Flag every instruction that a live jump can reach, patterns must not straddle those. */
+static void markTargets(Optimizer *optimizer) {
+  for (int i = 0; i <= optimizer->count; i++) {
+    optimizer->code[i].isTarget = false;
+  }
+  for (int i = 0; i < optimizer->count; i++) {
+    if (!optimizer->code[i].isDead && optimizer->code[i].target != -1) {
+      optimizer->code[resolve(optimizer, optimizer->code[i].target)].isTarget = true;
+    }
+  }
+}
+
+/* Bit-for-bit comparison, so that folding never merges 0 with -0. */
+static bool sameConstant(Value a, Value b) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  return IS_OBJ(a) && IS_OBJ(b) && AS_OBJ(a) == AS_OBJ(b);
+}
+
+/* Rewrite the instruction as OP_CONSTANT loading the given value. Reuses an existing pool
+entry when there is one; fails if a new entry would not fit into the one-byte operand. */
+static bool rewriteConstant(Optimizer *optimizer, int index, Value value) {
+  Chunk *chunk = optimizer->chunk;
+  int constant = -1;
+  for (int i = 0; i < chunk->constants.entries && i <= UINT8_MAX; i++) {
+    if (sameConstant(chunk->constants.values[i], value)) {
+      constant = i;
+      break;
+    }
+  }
+
+  if (constant == -1) {
+    if (chunk->constants.entries > UINT8_MAX) {
+      return false;
+    }
+    constant = addConstant(optimizer->vm, chunk, value);
+    WRITE_BARRIER(optimizer->vm, optimizer->function);
+  }
+
+  Instruction *instruction = &optimizer->code[index];
+  chunk->code[instruction->offset] = OP_CONSTANT;
+  chunk->code[instruction->offset + 1] = (uint8_t)constant;
+  instruction->length = 2;
+  return true;
+}
+
+static void rewriteSimple(Optimizer *optimizer, int index, uint8_t instruction) {
+  optimizer->chunk->code[optimizer->code[index].offset] = instruction;
+  optimizer->code[index].length = 1;
+}
+
+static Value constantAt(Optimizer *optimizer, int index) {
+  return optimizer->chunk->constants.values[optimizer->chunk->code[optimizer->code[index].offset + 1]];
+}
+
+/* Evaluate an operator applied to two constants at compile time. Only combinations that
+can not fail at runtime are folded, everything else keeps its runtime error. */
+static bool foldBinary(Optimizer *optimizer, int left, int right, uint8_t instruction) {
+  Value a = constantAt(optimizer, left);
+  Value b = constantAt(optimizer, right);
+
+  if (instruction == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+    ObjString *first = AS_STRING(a);
+    ObjString *second = AS_STRING(b);
+    int length = first->length + second->length;
+    char *chars = ALLOCATE(optimizer->vm, char, length + 1);
+    memcpy(chars, first->chars, first->length);
+    memcpy(chars + first->length, second->chars, second->length);
+    chars[length] = '\0';
+    return rewriteConstant(optimizer, left, OBJ_VAL(newString(optimizer->vm, chars, length)));
+  }
+
+  if (instruction == OP_EQUAL) {
+    rewriteSimple(optimizer, left, valuesEqual(a, b) ? OP_TRUE : OP_FALSE);
+    return true;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    return false;
+  }
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+
+  switch (instruction) {
+    case OP_GREATER:  rewriteSimple(optimizer, left, x > y ? OP_TRUE : OP_FALSE); return true;
+    case OP_LESS:     rewriteSimple(optimizer, left, x < y ? OP_TRUE : OP_FALSE); return true;
+    case OP_ADD:      return rewriteConstant(optimizer, left, NUMBER_VAL(x + y));
+    case OP_SUBTRACT: return rewriteConstant(optimizer, left, NUMBER_VAL(x - y));
+    case OP_MULTIPLY: return rewriteConstant(optimizer, left, NUMBER_VAL(x * y));
+    case OP_DIVIDE:   return rewriteConstant(optimizer, left, NUMBER_VAL(x / y));
+    default:          return false;
+  }
+}
+
+static bool isBinaryOperator(uint8_t instruction) {
+  switch (instruction) {
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/* Constant folding: CONSTANT a, CONSTANT b, <op> becomes CONSTANT (a op b); CONSTANT n,
+NEGATE becomes CONSTANT -n; a literal followed by NOT becomes the opposite literal. */
+static bool foldConstants(Optimizer *optimizer) {
+  bool changed = false;
+  for (int i = resolve(optimizer, 0); i < optimizer->count; i = nextLive(optimizer, i)) {
+    uint8_t instruction = opcodeAt(optimizer, i);
+    int second = nextLive(optimizer, i);
+    if (second == optimizer->count || optimizer->code[second].isTarget) continue;
+    uint8_t next = opcodeAt(optimizer, second);
+
+    if (instruction == OP_CONSTANT && next == OP_CONSTANT) {
+      int third = nextLive(optimizer, second);
+      if (third == optimizer->count || optimizer->code[third].isTarget) continue;
+      uint8_t operator = opcodeAt(optimizer, third);
+      if (isBinaryOperator(operator) && foldBinary(optimizer, i, second, operator)) {
+        optimizer->code[second].isDead = true;
+        optimizer->code[third].isDead = true;
+        changed = true;
+      }
+    } else if (instruction == OP_CONSTANT && next == OP_NEGATE) {
+      Value value = constantAt(optimizer, i);
+      if (IS_NUMBER(value) && rewriteConstant(optimizer, i, NUMBER_VAL(-AS_NUMBER(value)))) {
+        optimizer->code[second].isDead = true;
+        changed = true;
+      }
+    } else if ((instruction == OP_NIL || instruction == OP_TRUE || instruction == OP_FALSE) && next == OP_NOT) {
+      rewriteSimple(optimizer, i, instruction == OP_TRUE ? OP_FALSE : OP_TRUE);
+      optimizer->code[second].isDead = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+/* Instructions that push a value without side effects and without a way to fail. */
+static bool isPurePush(uint8_t instruction) {
+  switch (instruction) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool producesBool(uint8_t instruction) {
+  switch (instruction) {
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT:
+    case OP_TRUE:
+    case OP_FALSE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/* Drop a pure push that is popped right away, and a NOT NOT pair applied to a value that
+is already a boolean. */
+static bool removeRedundant(Optimizer *optimizer) {
+  bool changed = false;
+  for (int i = resolve(optimizer, 0); i < optimizer->count; i = nextLive(optimizer, i)) {
+    int second = nextLive(optimizer, i);
+    if (second == optimizer->count || optimizer->code[second].isTarget) continue;
+    uint8_t instruction = opcodeAt(optimizer, i);
+    uint8_t next = opcodeAt(optimizer, second);
+
+    if (isPurePush(instruction) && next == OP_POP) {
+      optimizer->code[i].isDead = true;
+      optimizer->code[second].isDead = true;
+      changed = true;
+    } else if (producesBool(instruction) && next == OP_NOT) {
+      int third = nextLive(optimizer, second);
+      if (third == optimizer->count || optimizer->code[third].isTarget) continue;
+      if (opcodeAt(optimizer, third) == OP_NOT) {
+        optimizer->code[second].isDead = true;
+        optimizer->code[third].isDead = true;
+        changed = true;
+      }
+    }
+  }
+  return changed;
+}
+
+/* Jump threading: a jump whose destination is an unconditional jump goes straight to the
+final destination, and a jump to the very next instruction is dropped. */
+static bool threadJumps(Optimizer *optimizer) {
+  bool changed = false;
+  for (int i = resolve(optimizer, 0); i < optimizer->count; i = nextLive(optimizer, i)) {
+    Instruction *jump = &optimizer->code[i];
+    if (jump->target == -1) continue;
+    bool isConditional = opcodeAt(optimizer, i) != OP_JUMP && opcodeAt(optimizer, i) != OP_LOOP;
+
+    int destination = resolve(optimizer, jump->target);
+    for (int steps = 0; steps < optimizer->count && destination < optimizer->count; steps++) {
+      uint8_t instruction = opcodeAt(optimizer, destination);
+      if (instruction != OP_JUMP && instruction != OP_LOOP) break;
+
+      int next = resolve(optimizer, optimizer->code[destination].target);
+      // Conditional jumps can only go forward; the compacted distance never exceeds the original one.
+      if (isConditional && next <= i) break;
+      int distance = optimizer->code[next].offset - (jump->offset + jump->length);
+      if (distance > UINT16_MAX || -distance > UINT16_MAX) break;
+      destination = next;
+    }
+
+    if (destination != jump->target) {
+      jump->target = destination;
+      changed = true;
+    }
+    if (destination == nextLive(optimizer, i)) {
+      jump->isDead = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+/* Nothing after an unconditional transfer of control runs until the next jump target. */
+static bool removeDeadCode(Optimizer *optimizer) {
+  bool changed = false;
+  for (int i = resolve(optimizer, 0); i < optimizer->count; i = nextLive(optimizer, i)) {
+    uint8_t instruction = opcodeAt(optimizer, i);
+    if (instruction != OP_RETURN && instruction != OP_JUMP && instruction != OP_LOOP) continue;
+
+    for (int dead = nextLive(optimizer, i); dead < optimizer->count && !optimizer->code[dead].isTarget;
+         dead = nextLive(optimizer, dead)) {
+      optimizer->code[dead].isDead = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+/* Check that the next count live instructions after the given one exist, are not jump
+targets and start with the expected opcodes. Collects their indices into window. */
+static bool matchWindow(Optimizer *optimizer, int index, const uint8_t *pattern, int count, int *window) {
+  window[0] = index;
+  if (opcodeAt(optimizer, index) != pattern[0]) return false;
+  for (int i = 1; i < count; i++) {
+    window[i] = nextLive(optimizer, window[i - 1]);
+    if (window[i] == optimizer->count || optimizer->code[window[i]].isTarget) return false;
+    if (opcodeAt(optimizer, window[i]) != pattern[i]) return false;
+  }
+  return true;
+}
+
+/* Replace a matched window with one superinstruction written over its first instruction.
+The fused instruction reports runtime errors on the line of the operator that can fail. */
+static void fuse(Optimizer *optimizer, int *window, int count, const uint8_t *bytes, int length, int line) {
+  Instruction *first = &optimizer->code[window[0]];
+  memcpy(optimizer->chunk->code + first->offset, bytes, length);
+  first->length = length;
+  first->line = line;
+  for (int i = 1; i < count; i++) {
+    optimizer->code[window[i]].isDead = true;
+  }
+}
+
+#ifdef REGISTER_BYTECODE
+/* The register forms of each arithmetic operator, with a slot or a constant on the right. */
+static const uint8_t registerForms[][3] = {
+  { OP_ADD,       OP_ADD_RR,       OP_ADD_RK },
+  { OP_SUBTRACT,  OP_SUBTRACT_RR,  OP_SUBTRACT_RK },
+  { OP_MULTIPLY,  OP_MULTIPLY_RR,  OP_MULTIPLY_RK },
+  { OP_DIVIDE,    OP_DIVIDE_RR,    OP_DIVIDE_RK },
+};
+
+static uint8_t operandAt(Optimizer *optimizer, int index) {
+  return optimizer->chunk->code[optimizer->code[index].offset + 1];
+}
+
+/* Lower a statement that stores into a local, like `a = b * c;` or `a = b;`, to a single
+register instruction. Every such statement leaves the stack as it found it, so dropping the
+pushes, the store and the trailing pop changes nothing else. */
+static bool selectRegisterForm(Optimizer *optimizer, int index) {
+  int window[5];
+  for (size_t i = 0; i < sizeof(registerForms) / sizeof(registerForms[0]); i++) {
+    const uint8_t *form = registerForms[i];
+    const uint8_t slots[] = { OP_GET_LOCAL, OP_GET_LOCAL, form[0], OP_SET_LOCAL, OP_POP };
+    const uint8_t constant[] = { OP_GET_LOCAL, OP_CONSTANT, form[0], OP_SET_LOCAL, OP_POP };
+    bool isSlot = matchWindow(optimizer, index, slots, 5, window);
+    if (isSlot || matchWindow(optimizer, index, constant, 5, window)) {
+      uint8_t bytes[] = { isSlot ? form[1] : form[2], operandAt(optimizer, window[3]),
+                          operandAt(optimizer, window[0]), operandAt(optimizer, window[1]) };
+      fuse(optimizer, window, 5, bytes, 4, optimizer->code[window[2]].line);
+      return true;
+    }
+  }
+
+  static const uint8_t move[] = { OP_GET_LOCAL, OP_SET_LOCAL, OP_POP };
+  static const uint8_t load[] = { OP_CONSTANT, OP_SET_LOCAL, OP_POP };
+  bool isMove = matchWindow(optimizer, index, move, 3, window);
+  if (isMove || matchWindow(optimizer, index, load, 3, window)) {
+    uint8_t bytes[] = { isMove ? OP_MOVE : OP_LOADK, operandAt(optimizer, window[1]), operandAt(optimizer, window[0]) };
+    fuse(optimizer, window, 3, bytes, 3, optimizer->code[window[0]].line);
+    return true;
+  }
+  return false;
+}
+#endif
+
+/* Superinstruction selection, once the other passes are done. Every fused form is shorter
+than the sequence it replaces and only the first instruction of the window may be a target. */
+static void selectSuperinstructions(Optimizer *optimizer) {
+  static const uint8_t increment[] = { OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP };
+  static const uint8_t addLocalConstant[] = { OP_GET_LOCAL, OP_CONSTANT, OP_ADD };
+  static const uint8_t lessJump[] = { OP_GET_LOCAL, OP_GET_LOCAL, OP_LESS, OP_JUMP_IF_FALSE };
+  uint8_t *code = optimizer->chunk->code;
+  int window[5];
+
+  markTargets(optimizer);
+  for (int i = resolve(optimizer, 0); i < optimizer->count; i = nextLive(optimizer, i)) {
+#ifdef REGISTER_BYTECODE
+    if (selectRegisterForm(optimizer, i)) continue;
+#endif
+    if (matchWindow(optimizer, i, increment, 5, window) &&
+        code[optimizer->code[window[0]].offset + 1] == code[optimizer->code[window[3]].offset + 1]) {
+      uint8_t bytes[] = { OP_INC_LOCAL, code[optimizer->code[window[0]].offset + 1], code[optimizer->code[window[1]].offset + 1] };
+      fuse(optimizer, window, 5, bytes, 3, optimizer->code[window[2]].line);
+    } else if (matchWindow(optimizer, i, addLocalConstant, 3, window)) {
+      uint8_t bytes[] = { OP_ADD_LOCAL_CONST, code[optimizer->code[window[0]].offset + 1], code[optimizer->code[window[1]].offset + 1] };
+      fuse(optimizer, window, 3, bytes, 3, optimizer->code[window[2]].line);
+    } else if (matchWindow(optimizer, i, lessJump, 4, window)) {
+      uint8_t bytes[] = { OP_LESS_LOCALS_JUMP, code[optimizer->code[window[0]].offset + 1], code[optimizer->code[window[1]].offset + 1], 0, 0 };
+      fuse(optimizer, window, 4, bytes, 5, optimizer->code[window[2]].line);
+      optimizer->code[i].target = optimizer->code[window[3]].target;
+    }
+  }
+}
+
+/* Slide the surviving instructions down over the removed ones, re-encode every jump for the
+new layout and carry each instruction's line along with it. */
+static void compact(Optimizer *optimizer) {
+  Chunk *chunk = optimizer->chunk;
+  int offset = 0;
+  for (int i = 0; i <= optimizer->count; i++) {
+    optimizer->code[i].newOffset = offset;
+    if (!optimizer->code[i].isDead) {
+      offset += optimizer->code[i].length;
+    }
+  }
+
+  int lineCount = 0;
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction *instruction = &optimizer->code[i];
+    if (instruction->isDead) continue;
+
+    // The destination never overlaps a later source: every instruction moves down, not up.
+    memmove(chunk->code + instruction->newOffset, chunk->code + instruction->offset, instruction->length);
+    /* Every line was decoded up front, so the runs are rebuilt in place. The live instructions
+    keep lines in their original order, which never takes more runs than before. */
+    if (lineCount == 0 || chunk->lines[lineCount - 1].line != instruction->line) {
+      chunk->lines[lineCount].offset = instruction->newOffset;
+      chunk->lines[lineCount].line = instruction->line;
+      lineCount++;
+    }
+
+    if (instruction->target != -1) {
+      uint8_t *code = chunk->code + instruction->newOffset;
+      int from = instruction->newOffset + instruction->length;
+      int to = optimizer->code[resolve(optimizer, instruction->target)].newOffset;
+      int jump = to - from;
+      if (code[0] == OP_JUMP || code[0] == OP_LOOP) {
+        code[0] = jump >= 0 ? OP_JUMP : OP_LOOP;
+      }
+      if (jump < 0) {
+        jump = -jump;
+      }
+      code[instruction->length - 2] = (jump >> 8) & 0xff;
+      code[instruction->length - 1] = jump & 0xff;
+    }
+  }
+  chunk->entries = offset;
+  chunk->lineCount = lineCount;
+}
+
+void optimizeFunction(VM *vm, ObjFunction *function) {
+  Optimizer optimizer;
+  optimizer.vm = vm;
+  optimizer.function = function;
+  optimizer.chunk = &function->chunk;
+  decode(&optimizer);
+
+  /* Every rewrite removes or shrinks an instruction, so this reaches a fixed point. */
+  bool changed;
+  do {
+    changed = false;
+    markTargets(&optimizer);
+    changed |= foldConstants(&optimizer);
+    markTargets(&optimizer);
+    changed |= removeRedundant(&optimizer);
+    changed |= threadJumps(&optimizer);
+    markTargets(&optimizer);
+    changed |= removeDeadCode(&optimizer);
+  } while (changed);
+
+  selectSuperinstructions(&optimizer);
+  compact(&optimizer);
+  FREE_ARRAY(vm, Instruction, optimizer.code, optimizer.count + 1);
+}
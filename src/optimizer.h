@@ -0,0 +1,14 @@
+/* This module is a peephole optimizer that rewrites the bytecode of a finished function. */
+
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "common.h"
+#include "object.h"
+
+/* Fold constant expressions, drop redundant instructions, thread jump chains and remove
+unreachable code, then compact the function's chunk in place. Line information moves with
+every surviving instruction. Constants created by folding are added to the chunk's pool. */
+void optimizeFunction(VM *vm, ObjFunction *function);
+
+#endif
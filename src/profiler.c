@@ -0,0 +1,225 @@
+/* clock_gettime() is POSIX, not ISO C; it reads the clock where there is no time stamp counter. */
+#define _POSIX_C_SOURCE 200809L
+
+#include "common.h"
+#include "debug.h"
+#include "memory.h"
+#include "profiler.h"
+#include "vm.h"
+
+#ifdef VM_PROFILER
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  #include <intrin.h>
+  #define PROFILE_CLOCK_UNIT "cycles"
+  static uint64_t readClock(void) { return __rdtsc(); }
+#elif defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define PROFILE_CLOCK_UNIT "cycles"
+  static uint64_t readClock(void) { return __rdtsc(); }
+#else
+  #include <time.h>
+  #define PROFILE_CLOCK_UNIT "ns"
+  static uint64_t readClock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+  }
+#endif
+
+#define PROFILE_TABLE_MAX_LOAD  0.5
+#define PROFILE_REPORT_ROWS     20
+
+void initProfiler(Profiler *profiler) {
+  memset(profiler, 0, sizeof(Profiler));
+  profiler->pendingOpcode = -1;
+}
+
+/* The table lives outside the managed heap: growing it mid-dispatch must not collect. */
+void freeProfiler(Profiler *profiler) {
+  free(profiler->entries);
+  initProfiler(profiler);
+}
+
+static uint32_t hashKey(ObjFunction *function, int line) {
+  uint64_t key = (uint64_t)(uintptr_t)function >> 4;
+  key = key * 31 + (uint32_t)line;
+  key ^= key >> 29;
+  key *= 0xbf58476d1ce4e5b9u;
+  return (uint32_t)(key ^ (key >> 32));
+}
+
+static ProfileEntry* findSlot(ProfileEntry *entries, int capacity, ObjFunction *function, int line) {
+  uint32_t index = hashKey(function, line) & (capacity - 1);
+  for (;;) {
+    ProfileEntry *entry = &entries[index];
+    if (entry->function == NULL || (entry->function == function && entry->line == line)) {
+      return entry;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+/* Make room for a few more entries up front, so that pointers returned by lookup() stay
+valid while an instruction is being accounted for. */
+static void reserve(Profiler *profiler, int extra) {
+  if (profiler->count + extra <= profiler->capacity * PROFILE_TABLE_MAX_LOAD) return;
+
+  int capacity = profiler->capacity < 64 ? 64 : profiler->capacity * 2;
+  ProfileEntry *entries = (ProfileEntry*)calloc(capacity, sizeof(ProfileEntry));
+  if (entries == NULL) {
+    fprintf(stderr, "Not enough memory for the profiler.\n");
+    exit(1);
+  }
+  for (int i = 0; i < profiler->capacity; i++) {
+    ProfileEntry *entry = &profiler->entries[i];
+    if (entry->function != NULL) {
+      *findSlot(entries, capacity, entry->function, entry->line) = *entry;
+    }
+  }
+  free(profiler->entries);
+  profiler->entries = entries;
+  profiler->capacity = capacity;
+}
+
+/* Find or create the statistics of a function (line -1) or of one of its lines. */
+static ProfileEntry* lookup(Profiler *profiler, ObjFunction *function, int line) {
+  ProfileEntry *entry = findSlot(profiler->entries, profiler->capacity, function, line);
+  if (entry->function == NULL) {
+    entry->function = function;
+    entry->line = line;
+    profiler->count++;
+  }
+  return entry;
+}
+
+static void charge(Profiler *profiler, uint64_t now) {
+  if (profiler->pendingOpcode == -1) return;
+  uint64_t ticks = now - profiler->start;
+  ProfileCounter *counters[] = {
+    &profiler->opcodes[profiler->pendingOpcode],
+    &profiler->pendingLine->counter,
+    &profiler->pendingFunction->counter,
+  };
+  for (int i = 0; i < 3; i++) {
+    counters[i]->count++;
+    counters[i]->ticks += ticks;
+  }
+}
+
+void profileInstruction(Profiler *profiler, ObjFunction *function, uint8_t *ip, int depth) {
+  charge(profiler, readClock());
+
+  int line = getLine(&function->chunk, (int)(ip - function->chunk.code));
+  bool isCall = profiler->pendingOpcode == -1 || depth > profiler->pendingDepth;
+  /* Most instructions come from the same line as the previous one, skip the lookups. */
+  if (profiler->pendingOpcode == -1 || profiler->pendingLine->function != function ||
+      profiler->pendingLine->line != line) {
+    reserve(profiler, 2);
+    profiler->pendingLine = lookup(profiler, function, line);
+    profiler->pendingFunction = lookup(profiler, function, -1);
+  }
+  if (isCall) {
+    profiler->pendingFunction->calls++;
+  }
+
+  profiler->pendingOpcode = *ip;
+  profiler->pendingDepth = depth;
+  /* Read the clock last, so the bookkeeping above is not billed to the instruction. */
+  profiler->start = readClock();
+}
+
+void profileStop(Profiler *profiler) {
+  charge(profiler, readClock());
+  profiler->pendingOpcode = -1;
+}
+
+void markProfilerRoots(VM *vm) {
+  Profiler *profiler = &vm->profiler;
+  for (int i = 0; i < profiler->capacity; i++) {
+    if (profiler->entries[i].function != NULL) {
+      markObject(vm, (Obj*)profiler->entries[i].function);
+    }
+  }
+}
+
+static const char* functionName(ObjFunction *function) {
+  return function->name != NULL ? function->name->chars : "<script>";
+}
+
+static double percent(uint64_t part, uint64_t total) {
+  return total == 0 ? 0.0 : 100.0 * (double)part / (double)total;
+}
+
+static int compareEntries(const void *a, const void *b) {
+  uint64_t x = (*(const ProfileEntry* const*)a)->counter.ticks;
+  uint64_t y = (*(const ProfileEntry* const*)b)->counter.ticks;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static THREAD_LOCAL const Profiler *sortedProfiler;   // qsort() has no context argument.
+
+static int compareOpcodes(const void *a, const void *b) {
+  uint64_t x = sortedProfiler->opcodes[*(const int*)a].ticks;
+  uint64_t y = sortedProfiler->opcodes[*(const int*)b].ticks;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Collect function totals (wantLines false) or line entries, sorted by time. */
+static int sortedEntries(Profiler *profiler, ProfileEntry **rows, bool wantLines) {
+  int count = 0;
+  for (int i = 0; i < profiler->capacity; i++) {
+    ProfileEntry *entry = &profiler->entries[i];
+    if (entry->function != NULL && (entry->line != -1) == wantLines) {
+      rows[count++] = entry;
+    }
+  }
+  qsort(rows, count, sizeof(ProfileEntry*), compareEntries);
+  return count;
+}
+
+void printProfile(Profiler *profiler) {
+  uint64_t total = 0;
+  uint64_t instructions = 0;
+  int opcodes[OP_COUNT];
+  for (int i = 0; i < OP_COUNT; i++) {
+    opcodes[i] = i;
+    total += profiler->opcodes[i].ticks;
+    instructions += profiler->opcodes[i].count;
+  }
+  sortedProfiler = profiler;
+  qsort(opcodes, OP_COUNT, sizeof(int), compareOpcodes);
+
+  fprintf(stderr, "== profile: %llu instructions, %llu %s ==\n",
+          (unsigned long long)instructions, (unsigned long long)total, PROFILE_CLOCK_UNIT);
+  fprintf(stderr, "%-20s %14s %16s %7s %10s\n", "opcode", "count", PROFILE_CLOCK_UNIT, "%", "per op");
+  for (int i = 0; i < OP_COUNT; i++) {
+    ProfileCounter *counter = &profiler->opcodes[opcodes[i]];
+    if (counter->count == 0) continue;
+    fprintf(stderr, "%-20s %14llu %16llu %6.2f%% %10.1f\n", opcodeName((uint8_t)opcodes[i]),
+            (unsigned long long)counter->count, (unsigned long long)counter->ticks,
+            percent(counter->ticks, total), (double)counter->ticks / (double)counter->count);
+  }
+
+  ProfileEntry **rows = (ProfileEntry**)malloc(sizeof(ProfileEntry*) * (profiler->count + 1));
+  if (rows == NULL) return;
+
+  int count = sortedEntries(profiler, rows, false);
+  fprintf(stderr, "\n%-20s %10s %14s %16s %7s\n", "function", "calls", "count", PROFILE_CLOCK_UNIT, "%");
+  for (int i = 0; i < count && i < PROFILE_REPORT_ROWS; i++) {
+    fprintf(stderr, "%-20s %10llu %14llu %16llu %6.2f%%\n", functionName(rows[i]->function),
+            (unsigned long long)rows[i]->calls, (unsigned long long)rows[i]->counter.count,
+            (unsigned long long)rows[i]->counter.ticks, percent(rows[i]->counter.ticks, total));
+  }
+
+  count = sortedEntries(profiler, rows, true);
+  fprintf(stderr, "\n%-6s %-20s %14s %16s %7s\n", "line", "function", "count", PROFILE_CLOCK_UNIT, "%");
+  for (int i = 0; i < count && i < PROFILE_REPORT_ROWS; i++) {
+    fprintf(stderr, "%-6d %-20s %14llu %16llu %6.2f%%\n", rows[i]->line, functionName(rows[i]->function),
+            (unsigned long long)rows[i]->counter.count, (unsigned long long)rows[i]->counter.ticks,
+            percent(rows[i]->counter.ticks, total));
+  }
+  free(rows);
+}
+
+#endif
@@ -0,0 +1,57 @@
+/* This module is an execution profiler for the VM: time and instruction counts per opcode, source line and function. */
+
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include "common.h"
+#include "object.h"
+
+#ifdef VM_PROFILER
+
+typedef struct {
+  uint64_t    count;        // Instructions executed.
+  uint64_t    ticks;        // Time spent on them, see PROFILE_CLOCK_UNIT.
+} ProfileCounter;
+
+/* A bucket of the statistics table, keyed by function and line. Line -1 holds the totals of
+the function itself. */
+typedef struct {
+  ObjFunction     *function;  // NULL marks an empty bucket.
+  int             line;
+  uint64_t        calls;      // Only kept on function totals.
+  ProfileCounter  counter;
+} ProfileEntry;
+
+/* Time is charged to an instruction when the next one starts. */
+typedef struct {
+  bool            enabled;
+  ProfileCounter  opcodes[OP_COUNT];
+  int             count;
+  int             capacity;
+  ProfileEntry    *entries;
+  uint64_t        start;          // When the pending instruction started.
+  int             pendingOpcode;  // -1 when nothing is being timed.
+  int             pendingDepth;   // Frame count of the pending instruction, to spot calls.
+  ProfileEntry    *pendingLine;
+  ProfileEntry    *pendingFunction;
+} Profiler;
+
+void initProfiler(Profiler *profiler);
+
+void freeProfiler(Profiler *profiler);
+
+/* Account for the instruction about to execute at ip, in a frame at the given depth. */
+void profileInstruction(Profiler *profiler, ObjFunction *function, uint8_t *ip, int depth);
+
+/* Charge the pending instruction, run() is returning. */
+void profileStop(Profiler *profiler);
+
+/* Keep every profiled function alive until the report, the table is keyed by them. */
+void markProfilerRoots(VM *vm);
+
+/* Print opcodes, functions and lines sorted by the time spent on them. */
+void printProfile(Profiler *profiler);
+
+#endif
+
+#endif
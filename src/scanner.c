@@ -7,17 +7,25 @@ looked at. A line field is used to track what line the current lexeme is on. */
 typedef struct Scanner_ {
   const char *start;
   const char *current;
+  const char *end;      // One past the last character, the source is not NUL-terminated.
   int line;
 } Scanner;
 
-Scanner scanner;
+THREAD_LOCAL Scanner scanner;
 
-void initScanner(const char *source) {
+void initScanner(const char *source, size_t length) {
   scanner.start = source;
   scanner.current = source;
+  scanner.end = source + length;
   scanner.line = 1;
 }
 
+void seekScanner(const char *position, int line) {
+  scanner.start = position;
+  scanner.current = position;
+  scanner.line = line;
+}
+
 /* Returns true if a given character belongs to alhabetical range; otherwise false. */
 static bool isAlpha(char c) {
   return  (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
@@ -28,9 +36,9 @@ static bool isDigit(char c) {
   return c >= '0' && c <= '9';
 }
 
-/* Returns true if the current character is a null terminator; otherwise - false. */
+/* Returns true if the whole source has been consumed; otherwise - false. */
 static bool isAtEnd() {
-  return *scanner.current == '\0';
+  return scanner.current == scanner.end;
 }
 
 /* Updates scanner register to the next character in a source stream, 
@@ -40,13 +48,15 @@ static char advance() {
   return scanner.current[-1];
 }
 
-/* Return the currently scanned character, do not update the scanner register. */
+/* Return the currently scanned character, do not update the scanner register.
+Past the end of the source this is '\0', the source itself may end right at a page boundary. */
 static char peek() {
+  if (isAtEnd()) { return '\0'; }
   return *scanner.current;
 }
 /* Return a character past the current one, do not update the scanner register. */
 static char peekNext() {
-  if (isAtEnd()) { return '\0'; }
+  if (scanner.end - scanner.current < 2) { return '\0'; }
   return scanner.current[1];
 }
 
@@ -203,6 +213,8 @@ Token scanToken() {
     case ')': return makeToken(TOKEN_RIGHT_PAREN);
     case '{': return makeToken(TOKEN_LEFT_BRACE);
     case '}': return makeToken(TOKEN_RIGHT_BRACE);
+    case '[': return makeToken(TOKEN_LEFT_BRACKET);
+    case ']': return makeToken(TOKEN_RIGHT_BRACKET);
     case ';': return makeToken(TOKEN_SEMICOLON);
     case ',': return makeToken(TOKEN_COMMA);
     case '.': return makeToken(TOKEN_DOT);
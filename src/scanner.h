@@ -3,10 +3,13 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "common.h"
+
 typedef enum TokenType_ {
   /* Single-character tokens. */
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
   /* One- or two-character tokens. */
@@ -33,8 +36,12 @@ typedef struct Token_ {
   int         line;
 } Token;
 
-/* Initialize the Scanner. */
-void initScanner(const char *source);
+/* Initialize the Scanner over the given number of characters. Tokens point into the source,
+so it must stay in place until the last token has been consumed. */
+void initScanner(const char *source, size_t length);
+
+/* Continue scanning from a position inside the source, which is on the given line. */
+void seekScanner(const char *position, int line);
 
 /* Request a new token from the Scanner. Returns one Token at a time. */
 Token scanToken();
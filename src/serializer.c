@@ -0,0 +1,396 @@
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "serializer.h"
+#include "vm.h"
+
+#ifdef _WIN32
+  #include <process.h>
+  #define getpid _getpid
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+/* File layout, every integer is little-endian:
+     header:   "LOXC", u32 version, u32 compile flags, u64 source hash
+     function: u32 arity, u32 upvalue count, name, u32 code length, code bytes,
+               u32 line run count, runs, u32 constant count, constants,
+               u32 property cache count, u32 name constant of each cache
+     run:      u32 offset of its first byte, u32 line
+     name:     u32 length (NO_NAME for the top-level script), bytes
+     constant: u8 tag, then a u64 number bit pattern, a name or a nested function */
+#define BYTECODE_MAGIC    "LOXC"
+#define HEADER_SIZE       20
+#define NO_NAME           UINT32_MAX
+
+/* How the bytecode was compiled. A build only loads the caches it would have written itself,
+so switching the optimizer or the register forms on or off recompiles every script. */
+#define FLAG_OPTIMIZED    0x1u
+#define FLAG_REGISTERS    0x2u
+
+static uint32_t compileFlags(void) {
+  uint32_t flags = 0;
+#ifdef OPTIMIZE_BYTECODE
+  flags |= FLAG_OPTIMIZED;
+  #ifdef REGISTER_BYTECODE
+    flags |= FLAG_REGISTERS;    // The register forms are selected by the optimizer.
+  #endif
+#endif
+  return flags;
+}
+
+typedef enum {
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+} ConstantTag;
+
+uint64_t hashSource(const char *source, size_t length) {
+  /* FNV-1a, 64-bit variant. */
+  uint64_t hash = 14695981039346656037u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)source[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+/* WRITING */
+
+typedef struct {
+  FILE    *file;
+  bool    failed;   // Sticky, checked once the whole tree has been written.
+} Writer;
+
+static void writeBytes(Writer *writer, const void *bytes, size_t length) {
+  if (length > 0 && fwrite(bytes, 1, length, writer->file) != length) {
+    writer->failed = true;
+  }
+}
+
+static void writeU8(Writer *writer, uint8_t value) {
+  writeBytes(writer, &value, 1);
+}
+
+static void writeU32(Writer *writer, uint32_t value) {
+  uint8_t bytes[4];
+  for (int i = 0; i < 4; i++) {
+    bytes[i] = (uint8_t)(value >> (8 * i));
+  }
+  writeBytes(writer, bytes, 4);
+}
+
+static void writeU64(Writer *writer, uint64_t value) {
+  uint8_t bytes[8];
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = (uint8_t)(value >> (8 * i));
+  }
+  writeBytes(writer, bytes, 8);
+}
+
+static void writeName(Writer *writer, ObjString *name) {
+  if (name == NULL) {
+    writeU32(writer, NO_NAME);
+    return;
+  }
+  writeU32(writer, (uint32_t)name->length);
+  writeBytes(writer, name->chars, name->length);
+}
+
+static void writeFunction(Writer *writer, ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  writeU32(writer, (uint32_t)function->arity);
+  writeU32(writer, (uint32_t)function->upvalueCount);
+  writeName(writer, function->name);
+
+  writeU32(writer, (uint32_t)chunk->entries);
+  writeBytes(writer, chunk->code, chunk->entries);
+  writeU32(writer, (uint32_t)chunk->lineCount);
+  for (int i = 0; i < chunk->lineCount; i++) {
+    writeU32(writer, (uint32_t)chunk->lines[i].offset);
+    writeU32(writer, (uint32_t)chunk->lines[i].line);
+  }
+
+  writeU32(writer, (uint32_t)chunk->constants.entries);
+  for (int i = 0; i < chunk->constants.entries; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_NUMBER(constant)) {
+      double number = AS_NUMBER(constant);
+      uint64_t bits;
+      memcpy(&bits, &number, sizeof(double));
+      writeU8(writer, CONSTANT_NUMBER);
+      writeU64(writer, bits);
+    } else if (IS_STRING(constant)) {
+      writeU8(writer, CONSTANT_STRING);
+      writeName(writer, AS_STRING(constant));
+    } else if (IS_FUNCTION(constant)) {
+      writeU8(writer, CONSTANT_FUNCTION);
+      writeFunction(writer, AS_FUNCTION(constant));
+    } else {
+      // The compiler only ever puts numbers, strings and functions into a constant pool.
+      writer->failed = true;
+    }
+  }
+
+  /* The caches start out empty again, only the names they are for are kept. */
+  writeU32(writer, (uint32_t)chunk->propertyCacheCount);
+  for (int i = 0; i < chunk->propertyCacheCount; i++) {
+    writeU32(writer, (uint32_t)chunk->propertyCaches[i].name);
+  }
+}
+
+bool writeBytecode(ObjFunction *function, uint64_t sourceHash, const char *path) {
+  /* Write to a private temporary file and rename it over the cache, so that concurrent runs
+  of the same script never observe a half-written file. */
+  size_t pathLength = strlen(path);
+  char *temporary = (char*)malloc(pathLength + 32);
+  if (temporary == NULL) {
+    return false;
+  }
+  snprintf(temporary, pathLength + 32, "%s.%ld.tmp", path, (long)getpid());
+
+  Writer writer;
+  writer.file = fopen(temporary, "wb");
+  writer.failed = writer.file == NULL;
+  if (!writer.failed) {
+    writeBytes(&writer, BYTECODE_MAGIC, 4);
+    writeU32(&writer, BYTECODE_VERSION);
+    writeU32(&writer, compileFlags());
+    writeU64(&writer, sourceHash);
+    writeFunction(&writer, function);
+    if (fclose(writer.file) != 0) {
+      writer.failed = true;
+    }
+  }
+
+  if (!writer.failed && rename(temporary, path) != 0) {
+    writer.failed = true;
+  }
+  if (writer.failed) {
+    remove(temporary);
+  }
+  free(temporary);
+  return !writer.failed;
+}
+
+/* READING */
+
+typedef struct {
+  const uint8_t *current;
+  const uint8_t *end;
+  bool          failed;   // Sticky: once set, every read returns zero.
+} Reader;
+
+/* Check that the given number of bytes is still available. */
+static bool ensure(Reader *reader, size_t length) {
+  if (reader->failed || (size_t)(reader->end - reader->current) < length) {
+    reader->failed = true;
+    return false;
+  }
+  return true;
+}
+
+static uint8_t readU8(Reader *reader) {
+  if (!ensure(reader, 1)) return 0;
+  return *reader->current++;
+}
+
+static uint32_t readU32(Reader *reader) {
+  if (!ensure(reader, 4)) return 0;
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    value |= (uint32_t)reader->current[i] << (8 * i);
+  }
+  reader->current += 4;
+  return value;
+}
+
+static uint64_t readU64(Reader *reader) {
+  if (!ensure(reader, 8)) return 0;
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= (uint64_t)reader->current[i] << (8 * i);
+  }
+  reader->current += 8;
+  return value;
+}
+
+static ObjString* readName(VM *vm, Reader *reader) {
+  uint32_t length = readU32(reader);
+  if (length == NO_NAME) {
+    return NULL;
+  }
+  if (length > INT32_MAX || !ensure(reader, length)) {
+    reader->failed = true;
+    return NULL;
+  }
+  ObjString *name = copyString(vm, (const char*)reader->current, (int)length);
+  reader->current += length;
+  return name;
+}
+
+static ObjFunction* readFunction(VM *vm, Reader *reader) {
+  ObjFunction *function = newFunction(vm);
+  /* Everything below allocates, keep the function reachable until its caller owns it. */
+  push(vm, OBJ_VAL(function));
+  Chunk *chunk = &function->chunk;
+
+  function->arity = (int)readU32(reader);
+  function->upvalueCount = (int)readU32(reader);
+  if (function->arity > UINT8_MAX || function->upvalueCount > OPERAND_LONG_MAX + 1) {
+    reader->failed = true;
+  }
+  // NO_NAME is only legal for the script itself, which is never nested.
+  function->name = readName(vm, reader);
+  WRITE_BARRIER(vm, function);
+
+  uint32_t length = readU32(reader);
+  if (length > 0 && length <= INT32_MAX && ensure(reader, length)) {
+    chunk->code = ALLOCATE(vm, uint8_t, length);
+    chunk->capacity = (int)length;
+    chunk->entries = (int)length;
+    memcpy(chunk->code, reader->current, length);
+    reader->current += length;
+  } else {
+    reader->failed = true;
+  }
+
+  /* The runs must cover the code from offset 0 on, each one starting past the one before. */
+  uint32_t runs = readU32(reader);
+  if (!reader->failed && runs > 0 && runs <= length && ensure(reader, (size_t)runs * 8)) {
+    chunk->lines = ALLOCATE(vm, LineStart, runs);
+    chunk->lineCapacity = (int)runs;
+    chunk->lineCount = (int)runs;
+    for (uint32_t i = 0; i < runs; i++) {
+      uint32_t offset = readU32(reader);
+      if (offset >= length || (i == 0 ? offset != 0 : offset <= (uint32_t)chunk->lines[i - 1].offset)) {
+        reader->failed = true;
+      }
+      chunk->lines[i].offset = (int)offset;
+      chunk->lines[i].line = (int)readU32(reader);
+    }
+  } else {
+    reader->failed = true;
+  }
+
+  uint32_t constants = readU32(reader);
+  for (uint32_t i = 0; i < constants && !reader->failed; i++) {
+    Value constant = NIL_VAL;
+    switch (readU8(reader)) {
+      case CONSTANT_NUMBER: {
+        uint64_t bits = readU64(reader);
+        double number;
+        memcpy(&number, &bits, sizeof(double));
+        constant = NUMBER_VAL(number);
+        break;
+      }
+      case CONSTANT_STRING: {
+        ObjString *string = readName(vm, reader);
+        if (string == NULL) {
+          reader->failed = true;
+        } else {
+          constant = OBJ_VAL(string);
+        }
+        break;
+      }
+      case CONSTANT_FUNCTION: {
+        ObjFunction *nested = readFunction(vm, reader);
+        if (nested == NULL || nested->name == NULL) {
+          reader->failed = true;
+        } else {
+          constant = OBJ_VAL(nested);
+        }
+        break;
+      }
+      default:
+        reader->failed = true;
+        break;
+    }
+    if (!reader->failed) {
+      addConstant(vm, chunk, constant);
+      WRITE_BARRIER(vm, function);
+    }
+  }
+
+  uint32_t caches = readU32(reader);
+  if (caches > OPERAND_LONG_MAX + 1) {
+    reader->failed = true;
+  }
+  for (uint32_t i = 0; i < caches && !reader->failed; i++) {
+    uint32_t name = readU32(reader);
+    if (name >= (uint32_t)chunk->constants.entries || !IS_STRING(chunk->constants.values[name])) {
+      reader->failed = true;
+    } else {
+      addPropertyCache(vm, chunk, (int)name);
+    }
+  }
+
+  pop(vm);
+  return reader->failed ? NULL : function;
+}
+
+/* Validate the header and decode the script function out of a complete file image. */
+static ObjFunction* readImage(VM *vm, uint64_t sourceHash, const uint8_t *image, size_t size) {
+  Reader reader;
+  reader.current = image;
+  reader.end = image + size;
+  reader.failed = size < HEADER_SIZE;
+  if (reader.failed || memcmp(image, BYTECODE_MAGIC, 4) != 0) {
+    return NULL;
+  }
+  reader.current += 4;
+  if (readU32(&reader) != BYTECODE_VERSION || readU32(&reader) != compileFlags() ||
+      readU64(&reader) != sourceHash) {
+    return NULL;
+  }
+
+  ObjFunction *function = readFunction(vm, &reader);
+  if (function == NULL || function->name != NULL || reader.current != reader.end) {
+    return NULL;
+  }
+  return function;
+}
+
+ObjFunction* readBytecode(VM *vm, uint64_t sourceHash, const char *path) {
+#ifdef _WIN32
+  /* No mmap, read the whole file instead. */
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  fseek(file, 0L, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+  uint8_t *image = size > 0 ? (uint8_t*)malloc((size_t)size) : NULL;
+  ObjFunction *function = NULL;
+  if (image != NULL && fread(image, 1, (size_t)size, file) == (size_t)size) {
+    function = readImage(vm, sourceHash, image, (size_t)size);
+  }
+  free(image);
+  fclose(file);
+  return function;
+#else
+  int descriptor = open(path, O_RDONLY);
+  if (descriptor < 0) {
+    return NULL;
+  }
+  struct stat status;
+  if (fstat(descriptor, &status) != 0 || status.st_size < HEADER_SIZE) {
+    close(descriptor);
+    return NULL;
+  }
+  size_t size = (size_t)status.st_size;
+  void *image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+  close(descriptor);
+  if (image == MAP_FAILED) {
+    return NULL;
+  }
+
+  ObjFunction *function = readImage(vm, sourceHash, (const uint8_t*)image, size);
+  munmap(image, size);
+  return function;
+#endif
+}
@@ -0,0 +1,24 @@
+/* This module saves compiled functions to disk and loads them back, so that unchanged scripts skip the compiler. */
+
+#ifndef clox_serializer_h
+#define clox_serializer_h
+
+#include "common.h"
+#include "object.h"
+
+/* Bump whenever the file layout or the instruction set changes. */
+#define BYTECODE_VERSION 8
+
+/* Content hash of a script's source, recorded in the cache file to detect stale caches. */
+uint64_t hashSource(const char *source, size_t length);
+
+/* Write a compiled script function and every function nested in it to the given path.
+Returns false if the file could not be written; a partially written cache is never left behind. */
+bool writeBytecode(ObjFunction *function, uint64_t sourceHash, const char *path);
+
+/* Map the cache file at the given path and rebuild the function tree inside the VM. Returns
+NULL if there is no such file, or it is malformed, from another format version, compiled by
+a build with different bytecode options or from a different source. */
+ObjFunction* readBytecode(VM *vm, uint64_t sourceHash, const char *path);
+
+#endif
@@ -0,0 +1,96 @@
+/* fdopen() is POSIX and madvise() a common extension, neither is declared in strict ISO C modes. */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include "common.h"
+#include "source.h"
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+/* No mapping, or the file could not be mapped (a pipe, say): read it into a heap buffer. */
+static SourceResult readSource(Source *source, FILE *file) {
+  size_t capacity = 0;
+  size_t length = 0;
+  char *buffer = NULL;
+  for (;;) {
+    if (length == capacity) {
+      capacity = capacity < 4096 ? 4096 : capacity * 2;
+      char *grown = (char *)realloc(buffer, capacity);
+      if (grown == NULL) {
+        free(buffer);
+        return SOURCE_NO_MEMORY;
+      }
+      buffer = grown;
+    }
+    size_t bytesRead = fread(buffer + length, sizeof(char), capacity - length, file);
+    length += bytesRead;
+    if (bytesRead == 0) break;
+  }
+  if (ferror(file)) {
+    free(buffer);
+    return SOURCE_CANNOT_READ;
+  }
+  source->chars = buffer;
+  source->length = length;
+  source->isMapped = false;
+  return SOURCE_OK;
+}
+
+SourceResult openSource(Source *source, const char *path) {
+  source->chars = NULL;
+  source->length = 0;
+  source->isMapped = false;
+
+#ifndef _WIN32
+  int descriptor = open(path, O_RDONLY);
+  if (descriptor < 0) {
+    return SOURCE_CANNOT_OPEN;
+  }
+  struct stat status;
+  if (fstat(descriptor, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0) {
+    size_t size = (size_t)status.st_size;
+    void *view = mmap(NULL, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    if (view != MAP_FAILED) {
+      /* The scanner walks the file front to back exactly once, let the kernel read ahead. */
+      madvise(view, size, MADV_SEQUENTIAL);
+      close(descriptor);
+      source->chars = (const char *)view;
+      source->length = size;
+      source->isMapped = true;
+      return SOURCE_OK;
+    }
+  }
+  FILE *file = fdopen(descriptor, "rb");
+  if (file == NULL) {
+    close(descriptor);
+    return SOURCE_CANNOT_OPEN;
+  }
+#else
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return SOURCE_CANNOT_OPEN;
+  }
+#endif
+  SourceResult result = readSource(source, file);
+  fclose(file);
+  return result;
+}
+
+void closeSource(Source *source) {
+#ifndef _WIN32
+  if (source->isMapped) {
+    munmap((void *)source->chars, source->length);
+  }
+#endif
+  if (!source->isMapped) {
+    free((void *)source->chars);
+  }
+  source->chars = NULL;
+  source->length = 0;
+  source->isMapped = false;
+}
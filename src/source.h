@@ -0,0 +1,29 @@
+/* This module opens script files for the scanner: mapped straight from the page cache where the
+platform allows it, so large sources are never copied onto the heap. */
+
+#ifndef clox_source_h
+#define clox_source_h
+
+#include "common.h"
+
+/* The characters of a script file. They are not NUL-terminated, the scanner stops at length. */
+typedef struct {
+  const char  *chars;
+  size_t      length;
+  bool        isMapped;   // chars is a read-only view of the file rather than a malloc'd copy.
+} Source;
+
+typedef enum {
+  SOURCE_OK,
+  SOURCE_CANNOT_OPEN,
+  SOURCE_NO_MEMORY,
+  SOURCE_CANNOT_READ,
+} SourceResult;
+
+/* Make the contents of the file at the given path available in source. The characters stay
+valid, and unchanged, until closeSource(). */
+SourceResult openSource(Source *source, const char *path);
+
+void closeSource(Source *source);
+
+#endif
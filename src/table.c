@@ -4,53 +4,124 @@
 
 #define TABLE_MAX_LOAD 0.75
 
+/* Control bytes. A full bucket holds the low 7 bits of its key's hash, so the high bit tells
+the special values apart. */
+#define CONTROL_EMPTY   0x80
+#define CONTROL_DELETED 0xfe
+
+/* Scan a group of TABLE_GROUP_WIDTH control bytes at once and return a mask with one bit set
+per byte equal to the given one; MATCH_SHIFT converts a bit index back to a byte index. */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define MATCH_SHIFT 0
+  static inline uint64_t matchByte(const uint8_t *group, uint8_t byte) {
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+  }
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+  #include <arm_neon.h>
+  #define MATCH_SHIFT 2
+  static inline uint64_t matchByte(const uint8_t *group, uint8_t byte) {
+    /* NEON has no movemask, narrow each 0x00/0xff lane to a nibble and keep one bit of it. */
+    uint8x16_t equal = vceqq_u8(vld1q_u8(group), vdupq_n_u8(byte));
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(equal), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x8888888888888888u;
+  }
+#else
+  #define MATCH_SHIFT 0
+  static inline uint64_t matchByte(const uint8_t *group, uint8_t byte) {
+    uint64_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+      mask |= (uint64_t)(group[i] == byte) << i;
+    }
+    return mask;
+  }
+#endif
+
+/* Pop the lowest match off a mask and return its byte index within the group. */
+static inline int nextMatch(uint64_t *mask) {
+#ifdef _MSC_VER
+  unsigned long bit;
+  _BitScanForward64(&bit, *mask);
+#else
+  int bit = __builtin_ctzll(*mask);
+#endif
+  *mask &= *mask - 1;
+  return (int)bit >> MATCH_SHIFT;
+}
+
+/* The high bits of the hash pick the first group to probe, the low 7 are kept in the control byte. */
+static inline uint32_t probeStart(uint32_t hash) {
+  return hash >> 7;
+}
+
+static inline uint8_t hashFragment(uint32_t hash) {
+  return (uint8_t)(hash & 0x7f);
+}
+
+/* Set the control byte of a bucket, and its mirror past the end, so that a group starting
+near the end of the array can be loaded without wrapping around. */
+static inline void setControl(Table* table, int index, uint8_t control) {
+  table->control[index] = control;
+  table->control[((index - TABLE_GROUP_WIDTH) & (table->capacity - 1)) + TABLE_GROUP_WIDTH] = control;
+}
+
 void initTable(Table* table) {
   table->count = 0;
   table->capacity = 0;
+  table->control = NULL;
   table->entries = NULL;
 }
 
-void freeTable(Table* table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM *vm, Table* table) {
+  FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+  FREE_ARRAY(vm, uint8_t, table->control, table->capacity == 0 ? 0 : table->capacity + TABLE_GROUP_WIDTH);
   initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-  /* Calculate the bucket index by maping the key’s hash code to this index within the array’s bounds. */
-  uint32_t index = key->hash % capacity;
-  Entry *tombstone = NULL;
-
-  for (;;) {
-    Entry *entry = &entries[index];
-    /*
-    If the key for the Entry at that array index is NULL -> the bucket is empty.
-      LOOK UP -> miss, there is no element
-      INSERT -> hit, we found a free bucket to add new Entry
-
-    If the key in the bucket = the key we’re looking for, then that key is already present in the table.
-      LOOK UP -> hit, e’ve found the key we seek.
-      INSERT -> we’ll be replacing the value for that key instead of adding a new entry.
-
-    Otherwise, the bucket has an entry in it, but with a different key -> Collision. Start probing.
-
-    Loop is used for linear displacement.
-    */
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // Empty entry.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // We found a tombstone.
-        if (tombstone == NULL) {
-          tombstone = entry;
-        }
+/* Interned keys are equal only if they are the same object, other strings are compared by
+content. Keys already stored in a table have been hashed on the way in. */
+static bool keysEqual(ObjString *a, ObjString *b) {
+  if (a == b) {
+    return true;
+  }
+  return (!a->isInterned || !b->isInterned) && a->length == b->length && a->hash == b->hash &&
+         memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+/* Return the index of the bucket holding the key, or -1 if it is not in the table. */
+static int findEntry(Table* table, ObjString* key) {
+  uint32_t hash = stringHash(key);
+  uint8_t fragment = hashFragment(hash);
+  uint32_t mask = (uint32_t)table->capacity - 1;
+
+  /* Probe one group after another. Only buckets whose control byte matches the hash fragment
+  are compared; a group with an empty bucket in it ends the probe sequence, since an insert
+  would have stopped there. */
+  for (uint32_t index = probeStart(hash) & mask;; index = (index + TABLE_GROUP_WIDTH) & mask) {
+    const uint8_t *group = &table->control[index];
+    for (uint64_t matches = matchByte(group, fragment); matches != 0;) {
+      int bucket = (int)((index + nextMatch(&matches)) & mask);
+      if (keysEqual(table->entries[bucket].key, key)) {
+        return bucket;
       }
-    } else if (entry->key == key) {
-      // We found the key.
-      return entry;
     }
-    /* Second modulo operator wraps us back around to the beginning. */
-    index = (index + 1) % capacity;
+    if (matchByte(group, CONTROL_EMPTY) != 0) {
+      return -1;
+    }
+  }
+}
+
+/* Return the first empty or deleted bucket on the probe sequence of a hash. */
+static int findFreeEntry(Table* table, uint32_t hash) {
+  uint32_t mask = (uint32_t)table->capacity - 1;
+  for (uint32_t index = probeStart(hash) & mask;; index = (index + TABLE_GROUP_WIDTH) & mask) {
+    const uint8_t *group = &table->control[index];
+    /* Both special values have the high bit set, full buckets never do. */
+    uint64_t available = matchByte(group, CONTROL_EMPTY) | matchByte(group, CONTROL_DELETED);
+    if (available != 0) {
+      return (int)((index + nextMatch(&available)) & mask);
+    }
   }
 }
 
@@ -59,26 +130,40 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     return false;
   }
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+  int index = findEntry(table, key);
+  if (index < 0) {
     return false;
   }
 
-  *value = entry->value;
+  *value = table->entries[index].value;
   return true;
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-  /* Allocate the bucket array, initialize every element to be an empty bucket 
-  and then store that array (and its capacity) in the hash table’s main struct. */
-  Entry *entries = ALLOCATE(Entry, capacity);
+Entry* tableGetEntry(Table* table, ObjString* key) {
+  if (table->count == 0) {
+    return NULL;
+  }
+
+  int index = findEntry(table, key);
+  return index < 0 ? NULL : &table->entries[index];
+}
+
+static void adjustCapacity(VM *vm, Table* table, int capacity) {
+  /* Allocate the bucket and control arrays, mark every bucket empty and then rehash the live
+  entries into them. Deleted buckets are dropped on the way. */
+  Entry *entries = ALLOCATE(vm, Entry, capacity);
+  uint8_t *control = ALLOCATE(vm, uint8_t, capacity + TABLE_GROUP_WIDTH);
   for (int i = 0; i < capacity; i++) {
     entries[i].key = NULL;
     entries[i].value = NIL_VAL;
   }
+  memset(control, CONTROL_EMPTY, capacity + TABLE_GROUP_WIDTH);
 
-  /* During the resizing of the array, we need to recalculate its size, so clear it out. */
-  table->count = 0;
+  Table resized;
+  resized.count = 0;
+  resized.capacity = capacity;
+  resized.control = control;
+  resized.entries = entries;
 
   /* Walk through the old array front to back.
   Any time we find a non-empty bucket, we insert that entry into the new array */
@@ -88,38 +173,39 @@ static void adjustCapacity(Table* table, int capacity) {
       continue; 
     } // Restart the loop.
 
-    Entry *dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
+    int index = findFreeEntry(&resized, entry->key->hash);
+    setControl(&resized, index, hashFragment(entry->key->hash));
+    resized.entries[index] = *entry;
     /* Count only for entries, not the toombstones. */
-    table->count++; 
+    resized.count++;
   }
-  /* Free the memory allocated for the old array. */
-  FREE_ARRAY(Entry, table->entries, table->capacity);
-  /* Update the table pointers. */
-  table->entries = entries;
-  table->capacity = capacity;
+  /* Free the memory allocated for the old arrays. */
+  freeTable(vm, table);
+  *table = resized;
 }
 
-bool tableSet(Table* table, ObjString* key, Value value) {
+bool tableSet(VM *vm, Table* table, ObjString* key, Value value) {
   /* Allocate enough memory to store the new entry. */
   if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
-  }
-  /* Look up a bucket for the given entry. */
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  /* Check if bucket is empty and only update table's size if it is. 
-  Do not increase the count if we overwrote the value for an already-present key. */
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value)) {
-    /* Toombstones are treated as full entries. */
+    int capacity = table->capacity < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH : table->capacity * 2;
+    adjustCapacity(vm, table, capacity);
+  }
+  /* Overwrite the value if the key is already present. */
+  int index = findEntry(table, key);
+  if (index >= 0) {
+    table->entries[index].value = value;
+    return false;
+  }
+  /* Otherwise take the first free bucket of the probe sequence. Reusing a deleted bucket
+  does not change the count, deleted buckets are counted as full ones. */
+  index = findFreeEntry(table, key->hash);
+  if (table->control[index] == CONTROL_EMPTY) {
     table->count++;
   }
-  /* Copy the key and value into the corresponding fields in the Entry. */
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+  setControl(table, index, hashFragment(key->hash));
+  table->entries[index].key = key;
+  table->entries[index].value = value;
+  return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
@@ -127,23 +213,24 @@ bool tableDelete(Table* table, ObjString* key) {
     return false;
   }
   // Find the entry.
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+  int index = findEntry(table, key);
+  if (index < 0) {
     return false;
   }
-  // Place a tombstone in the entry.
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  // Mark the bucket deleted, probe sequences running through it must carry on.
+  setControl(table, index, CONTROL_DELETED);
+  table->entries[index].key = NULL;
+  table->entries[index].value = NIL_VAL;
   return true;
 }
 
 /* Walk the bucket array of the source hash table. Whenever we find a non-empty bucket,
 we add the entry to the destination hash table. */
-void tableAddAll(Table* from, Table* to) {
+void tableAddAll(VM *vm, Table* from, Table* to) {
   for (int i = 0; i < from->capacity; i++) {
     Entry *entry = &from->entries[i];
     if (entry->key != NULL) {
-      tableSet(to, entry->key, entry->value);
+      tableSet(vm, to, entry->key, entry->value);
     }
   }
 }
@@ -152,22 +239,50 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
   if (table->count == 0) {
     return NULL;
   }
-  uint32_t index = hash % table->capacity;
+  uint8_t fragment = hashFragment(hash);
+  uint32_t mask = (uint32_t)table->capacity - 1;
 
-  for (;;) {
-    Entry *entry = &table->entries[index];
-    if (entry->key == NULL) {
-      // Stop if we find an empty non-tombstone entry.
-      if (IS_NIL(entry->value)) {
-        return NULL;
+  for (uint32_t index = probeStart(hash) & mask;; index = (index + TABLE_GROUP_WIDTH) & mask) {
+    const uint8_t *group = &table->control[index];
+    for (uint64_t matches = matchByte(group, fragment); matches != 0;) {
+      ObjString *key = table->entries[(index + nextMatch(&matches)) & mask].key;
+      /* Matching fragments are only a hint. Compare the lengths and full hashes first, and
+      only on a match do an actual character-by-character string comparison. */
+      if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) {
+        // We found it.
+        return key;
       }
-      /* Look at the actual strings. First, check if they have matching lengths and hashes.
-         If there is a hash collision, we do an actual character-by-character string comparison.
-      */
-    } else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-      // We found it.
-      return entry->key;
     }
-    index = (index + 1) % table->capacity;
+    // Stop if the group has an empty bucket.
+    if (matchByte(group, CONTROL_EMPTY) != 0) {
+      return NULL;
+    }
+  }
+}
+
+void tableRemoveWhite(Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    if (entry->key != NULL && !entry->key->obj.isMarked) {
+      tableDelete(table, entry->key);
+    }
+  }
+}
+
+int tableLiveCount(Table* table) {
+  int live = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    if (table->entries[i].key != NULL) {
+      live++;
+    }
+  }
+  return live;
+}
+
+void markTable(VM *vm, Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    markObject(vm, (Obj*)entry->key);
+    markValue(vm, entry->value);
   }
 }
@@ -4,36 +4,57 @@
 #include "common.h"
 #include "value.h"
 
+/* Keys must be flat strings. Runtime strings are hashed when they are first used as a key. */
 typedef struct {
   ObjString *key;
   Value     value;
 } Entry;
 
+/* An open-addressing table laid out like a Swiss table: besides the buckets, one control byte
+per bucket records whether it is empty, deleted, or full along with 7 bits of its key's hash.
+Lookups scan the control bytes a group at a time, and only touch the buckets whose hash bits
+match. The capacity is always a power of two of at least TABLE_GROUP_WIDTH. */
+#define TABLE_GROUP_WIDTH 16
+
 typedef struct {
-  int   count;
-  int   capacity;
-  Entry *entries;
+  int     count;    // Full and deleted buckets.
+  int     capacity;
+  uint8_t *control; // capacity + TABLE_GROUP_WIDTH bytes, the tail mirrors the head.
+  Entry   *entries; // Empty and deleted buckets have a NULL key.
 } Table;
 
 void initTable(Table* table);
 
-void freeTable(Table* table);
+void freeTable(VM *vm, Table* table);
 
 /* Given a key, look up the corresponding value. If it finds an entry with that key, 
 it returns true, otherwise it returns false. If the entry exists, the value output 
 parameter points to the resulting value.*/
 bool tableGet(Table* table, ObjString* key, Value* value);
 
+/* Return the entry holding the given key, or NULL if the key is not in the table. The pointer
+stays valid until the table is resized. */
+Entry* tableGetEntry(Table* table, ObjString* key);
+
 /* Add the given key/value pair to the given hash table. If an entry for that key is
 already present, the new value overwrites the old value. The function returns true if
 a new entry was added. */
-bool tableSet(Table* table, ObjString* key, Value value);
+bool tableSet(VM *vm, Table* table, ObjString* key, Value value);
 
 bool tableDelete(Table* table, ObjString* key);
 
 /* Copy all of the entries of one hash table into another. */
-void tableAddAll(Table* from, Table* to);
+void tableAddAll(VM *vm, Table* from, Table* to);
 
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
+/* Delete every entry whose key was not marked by the garbage collector. */
+void tableRemoveWhite(Table* table);
+
+/* Number of buckets holding a key. Unlike count, deleted buckets are not included. */
+int tableLiveCount(Table* table);
+
+/* Mark every key and value stored in the table as reachable. */
+void markTable(VM *vm, Table* table);
+
 #endif
@@ -8,41 +8,73 @@ void initValueArray(ValueArray *array) {
   array->values = NULL;
 }
 
-void writeValueArray(ValueArray *array, Value value) {
+void writeValueArray(VM *vm, ValueArray *array, Value value) {
   if (array->capacity < array->entries + 1) {
     /* Not enough space, increase capacity of the array. */
     int oldCapacity = array->capacity;
     array->capacity = GROW_CAPACITY(oldCapacity);
     /* Reallocate memory */
-    array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+    array->values = GROW_ARRAY(vm, Value, array->values, oldCapacity, array->capacity);
   }
   /* Write constant, update entries counter. */
   array->values[array->entries] = value;
   array->entries++;
 }
 
-void freeValueArray(ValueArray *array) {
-  FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM *vm, ValueArray *array) {
+  FREE_ARRAY(vm, Value, array->values, array->capacity);
   /* Re-init to make sure no dangling pointers had left. */
   initValueArray(array);
 }
 
 void printValue(Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    printObject(value);
+  }
+#else
   switch (value.type) {
     case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
     case VAL_NIL: printf("nil"); break;
     case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
     case VAL_OBJ: printObject(value); break;
   }
+#endif
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  /* Compare numbers as doubles so that NaN != NaN, like the tagged representation does. */
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  if (a == b) {
+    return true;
+  }
+#else
   if (a.type != b.type) { return false; }
   switch (a.type) {
     case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:    return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-    case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_OBJ:    if (AS_OBJ(a) == AS_OBJ(b)) return true; break;
     default:         return false; // Unreachable.
   }
+#endif
+  /* Interned strings are equal only if they are the same object, ropes must be compared. */
+  if (!IS_STRING(a) || !IS_STRING(b)) {
+    return false;
+  }
+  ObjString *first = AS_STRING(a);
+  ObjString *second = AS_STRING(b);
+  if ((first->isInterned && second->isInterned) || first->length != second->length) {
+    return false;
+  }
+  return memcmp(first->chars, second->chars, first->length) == 0;
 }
@@ -7,6 +7,55 @@
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+/* NaN-boxed values: every Value is a single 64-bit word. Numbers are stored as raw doubles,
+everything else hides in the payload of a quiet NaN. Objects additionally set the sign bit
+and keep the pointer in the low 48 bits; nil, true and false are small tags in the low bits. */
+typedef uint64_t Value;
+
+#define SIGN_BIT            ((uint64_t)0x8000000000000000)
+#define QNAN                ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL             1 // 01.
+#define TAG_FALSE           2 // 10.
+#define TAG_TRUE            3 // 11.
+
+#define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+/* Return true if the Value has the expected type. */
+#define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+/* Given a Value of the right type, unwrap it and return the corresponding raw C value. */
+#define AS_BOOL(value)      ((value) == TRUE_VAL)
+#define AS_NUMBER(value)    valueToNum(value)
+#define AS_OBJ(value)       ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+/* Take a C value of the appropriate type and produce a Value with the matching bit pattern. */
+#define BOOL_VAL(b)         ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(num)     numToValue(num)
+#define OBJ_VAL(obj)        (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+/* Type punning through memcpy, compilers turn it into a plain register move. */
+static inline double valueToNum(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+static inline Value numToValue(double num) {
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+#else
+
 /* The value tag. */
 typedef enum ValueType_ {
   VAL_BOOL,
@@ -42,23 +91,25 @@ typedef struct Value_ {
 #define NUMBER_VAL(value)   ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)     ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+#endif
+
 typedef struct {
   int     capacity;
   int     entries;
   Value   *values;
 } ValueArray;
 
-/* Check if the values are equal. */
+/* Check if the values are equal. Strings must be flat, see flattenString(). */
 bool valuesEqual(Value a, Value b);
 
 /* Initialize the new array of constants. */
 void initValueArray(ValueArray *array);
 
 /* Append the constant to the array. */
-void writeValueArray(ValueArray *array, Value value);
+void writeValueArray(VM *vm, ValueArray *array, Value value);
 
 /* Destroy the array of constants. */
-void freeValueArray(ValueArray *array);
+void freeValueArray(VM *vm, ValueArray *array);
 
 /* Print the value stored. */
 void printValue(Value value);
@@ -1,3 +1,6 @@
+/* clock_gettime() for the time slices is POSIX, not ISO C. */
+#define _POSIX_C_SOURCE 200809L
+
 #include "vm.h"
 #include "chunk.h"
 #include "memory.h"
@@ -8,35 +11,179 @@
 
 #include <time.h>
 
-VM vm;
+static bool clockNative(VM *vm, int argCount, Value *args, Value *result) {
+  *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+/* The number of elements of a list or characters of a string. */
+static bool lenNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (IS_LIST(args[0])) {
+    *result = NUMBER_VAL(AS_LIST(args[0])->items.entries);
+  } else if (IS_STRING(args[0])) {
+    *result = NUMBER_VAL(AS_STRING(args[0])->length);
+  } else {
+    nativeError(vm, "len() expects a list or a string.");
+    return false;
+  }
+  return true;
+}
+
+/* Append a value to a list and return the list. */
+static bool appendNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!IS_LIST(args[0])) {
+    nativeError(vm, "append() expects a list.");
+    return false;
+  }
+  /* Both arguments are still on the VM stack while the list grows. */
+  appendToList(vm, AS_LIST(args[0]), args[1]);
+  *result = args[0];
+  return true;
+}
+
+/* True if the string holds exactly the given name. Ropes are never short enough to be one. */
+static bool isName(ObjString *string, const char *name) {
+  size_t length = strlen(name);
+  return string->chars != NULL && (size_t)string->length == length &&
+         memcmp(string->chars, name, length) == 0;
+}
+
+/* heapStat(name): one figure of getHeapStats() by name, nil for an unknown one. */
+static bool heapStatNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!IS_STRING(args[0])) {
+    nativeError(vm, "heapStat() expects a string.");
+    return false;
+  }
+  HeapStats stats;
+  getHeapStats(vm, &stats);
+  ObjString *name = AS_STRING(args[0]);
+  double figure;
+  if (isName(name, "bytes"))                 figure = (double)stats.bytesAllocated;
+  else if (isName(name, "peakBytes"))        figure = (double)stats.peakBytesAllocated;
+  else if (isName(name, "totalBytes"))       figure = (double)stats.totalBytesAllocated;
+  else if (isName(name, "nextGC"))           figure = (double)stats.nextGC;
+  else if (isName(name, "collections"))      figure = (double)stats.collections;
+  else if (isName(name, "fullCollections"))  figure = (double)stats.fullCollections;
+  else if (isName(name, "globals"))          figure = stats.globals.live;
+  else if (isName(name, "globalsCapacity"))  figure = stats.globals.capacity;
+  else if (isName(name, "strings"))          figure = stats.strings.live;
+  else if (isName(name, "stringsCapacity"))  figure = stats.strings.capacity;
+  else {
+    *result = NIL_VAL;
+    return true;
+  }
+  *result = NUMBER_VAL(figure);
+  return true;
+}
+
+/* Names of the object types for objectCount(), indexed by ObjType. */
+static const char *objectTypeNames[OBJ_TYPE_COUNT] = {
+  [OBJ_BOUND_METHOD] = "boundMethod",
+  [OBJ_CLASS] = "class",
+  [OBJ_CLOSURE] = "closure",
+  [OBJ_FUNCTION] = "function",
+  [OBJ_INSTANCE] = "instance",
+  [OBJ_LIST] = "list",
+  [OBJ_NATIVE] = "native",
+  [OBJ_SHAPE] = "shape",
+  [OBJ_STRING] = "string",
+  [OBJ_UPVALUE] = "upvalue",
+};
+
+/* objectCount(type): live objects of the named type (nil for an unknown one), or of every type
+without an argument. Objects that became garbage still count until the collector sweeps them. */
+static bool objectCountNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (argCount == 0) {
+    int total = 0;
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+      total += vm->objectCounts[i];
+    }
+    *result = NUMBER_VAL(total);
+    return true;
+  }
+  if (argCount > 1 || !IS_STRING(args[0])) {
+    nativeError(vm, "objectCount() expects no argument or a string.");
+    return false;
+  }
+  *result = NIL_VAL;
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    if (isName(AS_STRING(args[0]), objectTypeNames[i])) {
+      *result = NUMBER_VAL(vm->objectCounts[i]);
+    }
+  }
+  return true;
+}
+
+static const NativeDef coreNatives[] = {
+  {"clock",       clockNative,        0},
+  {"len",         lenNative,          1},
+  {"append",      appendNative,       2},
+  {"heapStat",    heapStatNative,     1},
+  {"objectCount", objectCountNative,  NATIVE_VARIADIC},
+  {NULL,          NULL,               0},
+};
 
-static Value clockNative(int argCount, Value* args) {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+/* Move the value stack to a buffer twice as large. Every pointer into the stack (stackTop, the
+frames' slots and the open upvalues) is rebased onto the new buffer, so only pointers held
+across a push() need to be re-read. The stack lives outside the managed heap: a push() must
+never collect, the value being pushed is not reachable yet. */
+static NOINLINE void growStack(VM *vm) {
+  int oldCapacity = (int)(vm->stackEnd - vm->stack);
+  int capacity = oldCapacity * 2;
+  Value *stack = (Value*)malloc(sizeof(Value) * capacity);
+  ObjUpvalue **openUpvalues = (ObjUpvalue**)realloc(vm->openUpvalues, sizeof(ObjUpvalue*) * capacity);
+  if (stack == NULL || openUpvalues == NULL) {
+    fprintf(stderr, "Not enough memory for the VM stack.\n");
+    exit(1);
+  }
+  memcpy(stack, vm->stack, sizeof(Value) * (vm->stackTop - vm->stack));
+
+  for (int i = 0; i < vm->frameCount; i++) {
+    vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+  }
+  memset(openUpvalues + oldCapacity, 0, sizeof(ObjUpvalue*) * (capacity - oldCapacity));
+  vm->openUpvalues = openUpvalues;
+  for (int i = 0; vm->openUpvalueCount > 0 && i < vm->stackTop - vm->stack; i++) {
+    if (openUpvalues[i] != NULL) {
+      openUpvalues[i]->location = stack + i;
+    }
+  }
+  vm->stackTop = stack + (vm->stackTop - vm->stack);
+  free(vm->stack);
+  vm->stack = stack;
+  vm->stackEnd = stack + capacity;
 }
 
-/* Set a pointer to the beginning of the array, to indicate that the stack is empty. */
-static void resetStack(void) {
-  vm.stackTop = vm.stack;
-  vm.frameCount = 0;
-  vm.openUpvalues = NULL;
+static void closeUpvalues(VM *vm, Value* last);
+
+/* Set a pointer to the beginning of the array, to indicate that the stack is empty. Closures
+that survive an aborted script keep the values their upvalues had at that point. */
+static void resetStack(VM *vm) {
+  closeUpvalues(vm, vm->stack);
+  vm->stackTop = vm->stack;
+  vm->frameCount = 0;
 }
 
+/* Frames shown at each end of the stack trace of a runtime error. */
+#define TRACE_FRAMES 16
+
 /* Report the runtime error. */
-static void runtimeError(const char *format, ...) {
-  /* Determine a number of arguments that were passed at the function call. */
-  va_list args;
-  va_start(args, format);
+static void reportError(VM *vm, const char *format, va_list args) {
   vfprintf(stderr, format, args); // stderr stream is used as buffer to compile the message to print.
-  va_end(args);
   fputs("\n", stderr);
 
-  /* Stack tracing. */
-  for (int i = vm.frameCount - 1; i >= 0; i--) {
-    CallFrame *frame = &vm.frames[i];
+  /* Stack tracing. A deep stack only shows its innermost and outermost frames. */
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    if (vm->frameCount > 2 * TRACE_FRAMES && i == vm->frameCount - 1 - TRACE_FRAMES) {
+      fprintf(stderr, "... %d more frames ...\n", vm->frameCount - 2 * TRACE_FRAMES);
+      i = TRACE_FRAMES;
+      continue;
+    }
+    CallFrame *frame = &vm->frames[i];
     ObjFunction *function = frame->closure->function;
 
     size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+    fprintf(stderr, "[line %d] in ", getLine(&function->chunk, (int)instruction));
 
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
@@ -44,119 +191,231 @@ static void runtimeError(const char *format, ...) {
       fprintf(stderr, "%s()\n", function->name->chars);
     }
   }
-  resetStack();
+  resetStack(vm);
+}
+
+static void runtimeError(VM *vm, const char *format, ...) {
+  /* Determine a number of arguments that were passed at the function call. */
+  va_list args;
+  va_start(args, format);
+  reportError(vm, format, args);
+  va_end(args);
+}
+
+void nativeError(VM *vm, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  reportError(vm, format, args);
+  va_end(args);
 }
 
-static void defineNative(const char* name, NativeFn function) {
-  push(OBJ_VAL(copyString(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-  pop();
-  pop();
+void defineNatives(VM *vm, const NativeDef *natives) {
+  for (const NativeDef *native = natives; native->name != NULL; native++) {
+    /* Keep the name and the native on the stack, the table may grow and collect. */
+    push(vm, OBJ_VAL(copyString(vm, native->name, (int)strlen(native->name))));
+    push(vm, OBJ_VAL(newNative(vm, native->function, native->arity)));
+    tableSet(vm, &vm->globals, AS_STRING(vm->stackTop[-2]), vm->stackTop[-1]);
+    pop(vm);
+    pop(vm);
+  }
 }
 
 /* VM boot subroutine. */
-void initVM(void) {
-  resetStack();
-  vm.objects = NULL;
+void initVM(VM *vm) {
+  initAllocator(&vm->allocator);
+  vm->stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL);
+  vm->openUpvalues = (ObjUpvalue**)calloc(STACK_INITIAL, sizeof(ObjUpvalue*));
+  vm->openUpvalueCount = 0;
+  vm->frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+  if (vm->stack == NULL || vm->openUpvalues == NULL || vm->frames == NULL) {
+    fprintf(stderr, "Not enough memory for the VM stack.\n");
+    exit(1);
+  }
+  vm->stackEnd = vm->stack + STACK_INITIAL;
+  vm->frameCapacity = FRAMES_INITIAL;
+#ifdef VM_PROFILER
+  initProfiler(&vm->profiler);
+#endif
+  resetStack(vm);
+  vm->objects = NULL;
+  vm->nursery = NULL;
+  vm->bytesAllocated = 0;
+  vm->nextGC = 1024 * 1024;
+  vm->nurseryBytes = 0;
+  vm->peakBytesAllocated = 0;
+  vm->totalBytesAllocated = 0;
+  vm->collections = 0;
+  vm->fullCollections = 0;
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    vm->objectCounts[i] = 0;
+  }
+
+  vm->grayCount = 0;
+  vm->grayCapacity = 0;
+  vm->grayStack = NULL;
+  vm->rememberedCount = 0;
+  vm->rememberedCapacity = 0;
+  vm->remembered = NULL;
+  vm->hostFunctions = NULL;
+  vm->sliceSteps = 0;
+  vm->sliceMicroseconds = 0;
+
+  initTable(&vm->globals);
+  initTable(&vm->strings);
+
+  defineNatives(vm, coreNatives);
+}
+
+static void getTableStats(Table *table, TableStats *stats) {
+  stats->live = tableLiveCount(table);
+  stats->used = table->count;
+  stats->capacity = table->capacity;
+}
 
-  initTable(&vm.globals);
-  initTable(&vm.strings);
+void getHeapStats(VM *vm, HeapStats *stats) {
+  stats->bytesAllocated = vm->bytesAllocated;
+  stats->peakBytesAllocated = vm->peakBytesAllocated;
+  stats->totalBytesAllocated = vm->totalBytesAllocated;
+  stats->nextGC = vm->nextGC;
+  stats->collections = vm->collections;
+  stats->fullCollections = vm->fullCollections;
+  memcpy(stats->objectCounts, vm->objectCounts, sizeof(stats->objectCounts));
+  getTableStats(&vm->globals, &stats->globals);
+  getTableStats(&vm->strings, &stats->strings);
+}
 
-  defineNative("clock", clockNative);
+const char* objectTypeName(ObjType type) {
+  return objectTypeNames[type];
 }
 
-void push(Value value) {
+void push(VM *vm, Value value) {
+  if (vm->stackTop == vm->stackEnd) {
+    growStack(vm);
+  }
   // Push the value to the top of the stuck, move top stack pointer up
-  *vm.stackTop = value;
-  vm.stackTop++;
+  *vm->stackTop = value;
+  vm->stackTop++;
 }
 
-Value pop(void) {
+Value pop(VM *vm) {
   // Move stack pointer down, deference and return the value
-  vm.stackTop--;
-  return *vm.stackTop;
+  vm->stackTop--;
+  return *vm->stackTop;
 }
 
 /* Return a Value from the stack without poping it. */
-static Value peek(int distance) {
+static Value peek(VM *vm, int distance) {
   // The distance determines how far down from the top of the stack to look: zero is the top, one is one slot down, etc.
-  return vm.stackTop[-1 - distance];
+  return vm->stackTop[-1 - distance];
 }
 
-static bool call(ObjClosure* closure, int argCount) {
+static bool call(VM *vm, ObjClosure* closure, int argCount) {
   /* Runtime error checking. */
   if (argCount != closure->function->arity) {
-    runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+    runtimeError(vm, "Expected %d arguments but got %d.", closure->function->arity, argCount);
     return false;
   }
 
-  /* CallFrame overflow mitigation during a deep call. */
-  if (vm.frameCount == FRAMES_MAX) {
-    runtimeError("Stack overflow.");
+  /* CallFrame overflow mitigation during a deep call. The stack limit budgets UINT8_COUNT
+  slots per frame, functions with more locals than that just use it up sooner. */
+  if (vm->frameCount == FRAMES_MAX || vm->stackTop - vm->stack > STACK_MAX - UINT8_COUNT) {
+    runtimeError(vm, "Stack overflow.");
     return false;
   }
+  if (vm->frameCount == vm->frameCapacity) {
+    /* Callers re-read their frame pointer after a call, moving the array is safe here. */
+    int capacity = vm->frameCapacity * 2;
+    CallFrame *frames = (CallFrame*)realloc(vm->frames, sizeof(CallFrame) * capacity);
+    if (frames == NULL) {
+      fprintf(stderr, "Not enough memory for the VM stack.\n");
+      exit(1);
+    }
+    vm->frames = frames;
+    vm->frameCapacity = capacity;
+  }
 
-  CallFrame *frame = &vm.frames[vm.frameCount++];
+  CallFrame *frame = &vm->frames[vm->frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
-  frame->slots = vm.stackTop - argCount - 1;
+  frame->slots = vm->stackTop - argCount - 1;
+  return true;
+}
+
+/* Natives run without a frame of their own. The result goes straight into the callee's slot,
+which needs no stack check: the arguments are popped, so there is always room for it. */
+static inline bool callNative(VM *vm, ObjNative *native, int argCount) {
+  if (native->arity != argCount && native->arity != NATIVE_VARIADIC) {
+    runtimeError(vm, "Expected %d arguments but got %d.", native->arity, argCount);
+    return false;
+  }
+  Value *args = vm->stackTop - argCount;
+  if (!native->function(vm, argCount, args, args - 1)) {
+    return false;
+  }
+  vm->stackTop = args;
   return true;
 }
 
-static bool callValue(Value callee, int argCount) {
+static bool callValue(VM *vm, Value callee, int argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
-      case OBJ_CLOSURE:
-        return call(AS_CLOSURE(callee), argCount);
-      case OBJ_NATIVE: {
-        NativeFn native = AS_NATIVE(callee);
-        Value result = native(argCount, vm.stackTop - argCount);
-        vm.stackTop -= argCount + 1;
-        push(result);
+      case OBJ_BOUND_METHOD: {
+        ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+        vm->stackTop[-argCount - 1] = bound->receiver;
+        return call(vm, bound->method, argCount);
+      }
+      case OBJ_CLASS: {
+        /* The new instance takes the place of the class, as the initializer's receiver. */
+        ObjClass *klass = AS_CLASS(callee);
+        vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
+        if (klass->initializer != NULL) {
+          return call(vm, klass->initializer, argCount);
+        }
+        if (argCount != 0) {
+          runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
+          return false;
+        }
         return true;
       }
+      case OBJ_CLOSURE:
+        return call(vm, AS_CLOSURE(callee), argCount);
+      case OBJ_NATIVE:
+        return callNative(vm, AS_NATIVE(callee), argCount);
       default:
         break; // Non-callable object type.
     }
   }
-  runtimeError("Can only call functions and classes.");
+  runtimeError(vm, "Can only call functions and classes.");
   return false;
 }
 
-static ObjUpvalue* captureUpvalue(Value* local) {
-  ObjUpvalue *prevUpvalue = NULL;
-  ObjUpvalue *upvalue = vm.openUpvalues;
-
-  while (upvalue != NULL && upvalue->location > local) {
-    prevUpvalue = upvalue;
-    upvalue = upvalue->next;
-  }
-
-  if (upvalue != NULL && upvalue->location == local) {
-    return upvalue;
-  }
-
-  ObjUpvalue *createdUpvalue = newUpvalue(local);
-  createdUpvalue->next = upvalue;
-
-  if (prevUpvalue == NULL) {
-    vm.openUpvalues = createdUpvalue;
-  } else {
-    prevUpvalue->next = createdUpvalue;
+/* Open upvalues are indexed by the stack slot they point to, so a closure capturing a local
+that is already captured finds its upvalue without a search. */
+static ObjUpvalue* captureUpvalue(VM *vm, Value* local) {
+  int slot = (int)(local - vm->stack);
+  if (vm->openUpvalues[slot] != NULL) {
+    return vm->openUpvalues[slot];
   }
 
+  ObjUpvalue *createdUpvalue = newUpvalue(vm, local);
+  vm->openUpvalues[slot] = createdUpvalue;
+  vm->openUpvalueCount++;
   return createdUpvalue;
 }
 
-static void closeUpvalues(Value* last) {
-  while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-    ObjUpvalue *upvalue = vm.openUpvalues;
+/* Close every open upvalue at or above the given slot. Only locals are ever captured and they
+are all below stackTop, so only the slots in between need to be looked at. */
+static void closeUpvalues(VM *vm, Value* last) {
+  for (int slot = (int)(last - vm->stack); vm->openUpvalueCount > 0 && slot < vm->stackTop - vm->stack; slot++) {
+    ObjUpvalue *upvalue = vm->openUpvalues[slot];
+    if (upvalue == NULL) continue;
 
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    WRITE_BARRIER(vm, upvalue);
 
-    vm.openUpvalues = upvalue->next;
+    vm->openUpvalues[slot] = NULL;
+    vm->openUpvalueCount--;
   }
 }
 
@@ -165,260 +424,1146 @@ static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-  /* Take both strinbg from the VM stack. */
-  ObjString *b = AS_STRING(pop());
-  ObjString *a = AS_STRING(pop());
-  /* Calculate the length of new string and allocate the memory block for it. */
+static void concatenate(VM *vm) {
+  /* Peek both strings, they must stay on the VM stack while the result is allocated. */
+  ObjString *b = AS_STRING(peek(vm, 0));
+  ObjString *a = AS_STRING(peek(vm, 1));
+  /* Calculate the length of new string. Long results are built lazily as a rope, so that
+  appending to a string in a loop does not copy everything produced so far every time. */
   int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length + 1);
-  /* Copy over first string, then the second one right after the first and append a 
-  NULL terminator char to the end.*/
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-  /* Produce new object to contain concatenated string. */
-  ObjString *result = takeString(chars, length);
-  push(OBJ_VAL(result));
+  ObjString *result;
+  if (length >= ROPE_MIN_LENGTH) {
+    result = newRope(vm, a, b);
+  } else {
+    /* Both operands are shorter than a rope, so they are flat. Copy over first string, then
+    the second one right after the first and append a NULL terminator char to the end.*/
+    char *chars = ALLOCATE(vm, char, length + 1);
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    chars[length] = '\0';
+    /* Produce new object to contain concatenated string, it is hashed only if it becomes a key. */
+    result = newString(vm, chars, length);
+  }
+  pop(vm);
+  pop(vm);
+  push(vm, OBJ_VAL(result));
+}
+
+/* Ropes only get their characters when something looks at them. */
+static void flattenValue(VM *vm, Value value) {
+  if (IS_ROPE(value)) {
+    flattenString(vm, AS_STRING(value));
+  }
 }
 
 /* VM terminating subroutine. */
-void freeVM(void) {
-  freeTable(&vm.globals);
-  freeTable(&vm.strings);
-  freeObjects();
+void freeVM(VM *vm) {
+  freeTable(vm, &vm->globals);
+  freeTable(vm, &vm->strings);
+#ifdef VM_PROFILER
+  if (vm->profiler.enabled) {
+    printProfile(&vm->profiler);
+  }
+  freeProfiler(&vm->profiler);
+#endif
+  freeObjects(vm);
+  freeAllocator(&vm->allocator);
+  free(vm->stack);
+  free(vm->openUpvalues);
+  free(vm->frames);
+  while (vm->hostFunctions != NULL) {
+    CloxFunction *next = vm->hostFunctions->next;
+    free(vm->hostFunctions);
+    vm->hostFunctions = next;
+  }
+}
+
+#ifdef COMPUTED_GOTO
+/* Labels-as-values is a GNU extension, keep -pedantic quiet about it inside run(). */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+/* Check that a value can be indexed by another and convert the index to an element position. */
+static bool checkIndex(VM *vm, Value list, Value index, int *position) {
+  if (!IS_LIST(list)) {
+    runtimeError(vm, "Only lists can be indexed.");
+    return false;
+  }
+  if (!IS_NUMBER(index)) {
+    runtimeError(vm, "List index must be a number.");
+    return false;
+  }
+  double number = AS_NUMBER(index);
+  int count = AS_LIST(list)->items.entries;
+  /* Written so that NaN fails the bounds check, before the conversion below could see it. */
+  if (!(number >= 0 && number < count)) {
+    runtimeError(vm, "List index %g out of bounds for a list of %d elements.", number, count);
+    return false;
+  }
+  if (number != (double)(int)number) {
+    runtimeError(vm, "List index must be an integer.");
+    return false;
+  }
+  *position = (int)number;
+  return true;
+}
+
+/* Find the globals entry for the global named by a constant, going through the constant's
+inline cache first. Returns NULL if the variable has never been defined. */
+static inline Entry* findGlobal(VM *vm, Chunk *chunk, int constant) {
+  ObjString *name = AS_STRING(chunk->constants.values[constant]);
+  GlobalCache *cache = &chunk->globalCaches[constant];
+  if (cache->capacity == vm->globals.capacity) {
+    Entry *entry = &vm->globals.entries[cache->slot];
+    /* The bucket may have been emptied by a delete or reused for another key. */
+    if (entry->key == name) {
+      return entry;
+    }
+  }
+
+  Entry *entry = tableGetEntry(&vm->globals, name);
+  if (entry != NULL) {
+    cache->capacity = vm->globals.capacity;
+    cache->slot = (int)(entry - vm->globals.entries);
+  }
+  return entry;
+}
+
+/* Push the value of the global named by a constant. Returns false after reporting an
+undefined variable. */
+static inline bool getGlobal(VM *vm, Chunk *chunk, int constant) {
+  Entry *global = findGlobal(vm, chunk, constant);
+  if (global == NULL) {
+    /* If the key isn’t present in the hash table, it means that global variable has never been defined. */
+    runtimeError(vm, "Undefined variable '%s'.", AS_STRING(chunk->constants.values[constant])->chars);
+    return false;
+  }
+  push(vm, global->value);
+  return true;
+}
+
+/* Assignment never creates a global, so only an existing entry is updated in place. */
+static inline bool setGlobal(VM *vm, Chunk *chunk, int constant) {
+  Entry *global = findGlobal(vm, chunk, constant);
+  if (global == NULL) {
+    runtimeError(vm, "Undefined variable '%s'.", AS_STRING(chunk->constants.values[constant])->chars);
+    return false;
+  }
+  global->value = peek(vm, 0);
+  return true;
+}
+
+/* The entry of the property cache for receivers of the given shape, NULL on a miss. */
+static inline PropertyCacheEntry* findCacheEntry(PropertyCache *cache, ObjShape *shape) {
+  for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+    if (cache->entries[i].shape == shape) {
+      return &cache->entries[i];
+    }
+  }
+  return NULL;
+}
+
+/* Record what the property resolved to for a new shape, in front of the entries already there. */
+static void fillCache(VM *vm, ObjFunction *function, PropertyCache *cache, PropertyCacheEntry entry) {
+  memmove(&cache->entries[1], &cache->entries[0], sizeof(PropertyCacheEntry) * (PROPERTY_CACHE_WAYS - 1));
+  cache->entries[0] = entry;
+  WRITE_BARRIER(vm, function);
+}
+
+static ObjString* cacheName(ObjFunction *function, PropertyCache *cache) {
+  return AS_STRING(function->chunk.constants.values[cache->name]);
+}
+
+/* Resolve the property for instances of the given shape, a field first and then a method of
+the class, and cache the result. Returns false if the instances have neither. */
+static bool lookUpProperty(VM *vm, ObjFunction *function, PropertyCache *cache, ObjShape *shape,
+                           PropertyCacheEntry *entry) {
+  ObjString *name = cacheName(function, cache);
+  entry->shape = shape;
+  entry->transition = NULL;
+  entry->method = NULL;
+  entry->slot = findField(shape, name);
+  if (entry->slot == -1) {
+    Value method;
+    if (!tableGet(&shape->klass->methods, name, &method)) {
+      runtimeError(vm, "Undefined property '%s'.", name->chars);
+      return false;
+    }
+    entry->method = AS_CLOSURE(method);
+  }
+  fillCache(vm, function, cache, *entry);
+  return true;
+}
+
+/* Replace the instance on top of the stack with the given method bound to it. */
+static void bindMethod(VM *vm, ObjClosure *method) {
+  ObjBoundMethod *bound = newBoundMethod(vm, peek(vm, 0), method);
+  vm->stackTop[-1] = OBJ_VAL(bound);
+}
+
+static NOINLINE bool getPropertyMiss(VM *vm, ObjFunction *function, PropertyCache *cache) {
+  if (!IS_INSTANCE(peek(vm, 0))) {
+    runtimeError(vm, "Only instances have properties.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(peek(vm, 0));
+  PropertyCacheEntry entry;
+  if (!lookUpProperty(vm, function, cache, instance->shape, &entry)) {
+    return false;
+  }
+  if (entry.slot >= 0) {
+    vm->stackTop[-1] = instance->fields[entry.slot];
+  } else {
+    bindMethod(vm, entry.method);
+  }
+  return true;
+}
+
+/* Replace the instance on top of the stack with the value of the property, a field or a bound
+method. */
+static inline bool getProperty(VM *vm, ObjFunction *function, int index) {
+  PropertyCache *cache = &function->chunk.propertyCaches[index];
+  Value receiver = peek(vm, 0);
+  if (IS_INSTANCE(receiver)) {
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    PropertyCacheEntry *entry = findCacheEntry(cache, instance->shape);
+    if (entry != NULL) {
+      if (entry->slot >= 0) {
+        vm->stackTop[-1] = instance->fields[entry->slot];
+      } else {
+        bindMethod(vm, entry->method);
+      }
+      return true;
+    }
+  }
+  return getPropertyMiss(vm, function, cache);
+}
+
+static NOINLINE bool setPropertyMiss(VM *vm, ObjFunction *function, PropertyCache *cache) {
+  if (!IS_INSTANCE(peek(vm, 1))) {
+    runtimeError(vm, "Only instances have fields.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(peek(vm, 1));
+  ObjString *name = cacheName(function, cache);
+  PropertyCacheEntry entry;
+  entry.shape = instance->shape;
+  entry.transition = NULL;
+  entry.method = NULL;
+  entry.slot = findField(instance->shape, name);
+  if (entry.slot >= 0) {
+    instance->fields[entry.slot] = peek(vm, 0);
+    WRITE_BARRIER(vm, instance);
+  } else {
+    /* Both the instance and the value are still on the stack while the field is added. */
+    addField(vm, instance, name, peek(vm, 0));
+    entry.transition = instance->shape;
+    entry.slot = instance->shape->fieldCount - 1;
+  }
+  /* A hit that only missed because the instance had no room left is already cached. */
+  if (findCacheEntry(cache, entry.shape) == NULL) {
+    fillCache(vm, function, cache, entry);
+  }
+  return true;
+}
+
+/* Store the value on top of the stack into the property of the instance below it and leave
+the value, assignment is an expression. Adding a field is cached as well, as the move from
+the shape without the field to the one with it. */
+static inline bool setProperty(VM *vm, ObjFunction *function, int index) {
+  PropertyCache *cache = &function->chunk.propertyCaches[index];
+  Value receiver = peek(vm, 1);
+  bool stored = false;
+  if (IS_INSTANCE(receiver)) {
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    PropertyCacheEntry *entry = findCacheEntry(cache, instance->shape);
+    if (entry != NULL && (entry->transition == NULL || entry->slot < instance->capacity)) {
+      instance->fields[entry->slot] = peek(vm, 0);
+      if (entry->transition != NULL) {
+        instance->shape = entry->transition;
+      }
+      WRITE_BARRIER(vm, instance);
+      stored = true;
+    }
+  }
+  if (!stored && !setPropertyMiss(vm, function, cache)) {
+    return false;
+  }
+  Value value = pop(vm);
+  vm->stackTop[-1] = value;
+  return true;
+}
+
+/* Call a field holding something callable like any other value, in place of the receiver. */
+static bool callField(VM *vm, ObjInstance *instance, int slot, int argCount) {
+  Value field = instance->fields[slot];
+  vm->stackTop[-argCount - 1] = field;
+  return callValue(vm, field, argCount);
+}
+
+static NOINLINE bool invokeMiss(VM *vm, ObjFunction *function, PropertyCache *cache, int argCount) {
+  if (!IS_INSTANCE(peek(vm, argCount))) {
+    runtimeError(vm, "Only instances have methods.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(peek(vm, argCount));
+  PropertyCacheEntry entry;
+  if (!lookUpProperty(vm, function, cache, instance->shape, &entry)) {
+    return false;
+  }
+  if (entry.slot >= 0) {
+    return callField(vm, instance, entry.slot, argCount);
+  }
+  return call(vm, entry.method, argCount);
+}
+
+/* Call the receiver's method straight away, without binding it first as OP_GET_PROPERTY
+followed by OP_CALL would. The receiver is already in the callee slot, it becomes "this". */
+static inline bool invoke(VM *vm, ObjFunction *function, int index, int argCount) {
+  PropertyCache *cache = &function->chunk.propertyCaches[index];
+  Value receiver = peek(vm, argCount);
+  if (IS_INSTANCE(receiver)) {
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    PropertyCacheEntry *entry = findCacheEntry(cache, instance->shape);
+    if (entry != NULL) {
+      if (entry->slot >= 0) {
+        return callField(vm, instance, entry->slot, argCount);
+      }
+      return call(vm, entry->method, argCount);
+    }
+  }
+  return invokeMiss(vm, function, cache, argCount);
+}
+
+/* Look a method up in the superclass on top of the stack, which is popped. Lookups through
+super have no cache, they always go to the class itself. */
+static ObjClosure* superMethod(VM *vm, ObjString *name) {
+  ObjClass *superclass = AS_CLASS(pop(vm));
+  Value method;
+  if (!tableGet(&superclass->methods, name, &method)) {
+    runtimeError(vm, "Undefined property '%s'.", name->chars);
+    return NULL;
+  }
+  return AS_CLOSURE(method);
+}
+
+/* Add the closure on top of the stack to the class below it. */
+static void defineMethod(VM *vm, ObjString *name) {
+  ObjClass *klass = AS_CLASS(peek(vm, 1));
+  tableSet(vm, &klass->methods, name, peek(vm, 0));
+  if (isName(name, "init")) {
+    klass->initializer = AS_CLOSURE(peek(vm, 0));
+  }
+  WRITE_BARRIER(vm, klass);
+  pop(vm);
+}
+
+/* Copy the superclass's methods down into the subclass, before the subclass defines its own.
+The subclass is popped, the superclass stays as the "super" local of the methods. */
+static bool inherit(VM *vm) {
+  if (!IS_CLASS(peek(vm, 1))) {
+    runtimeError(vm, "Superclass must be a class.");
+    return false;
+  }
+  ObjClass *superclass = AS_CLASS(peek(vm, 1));
+  ObjClass *subclass = AS_CLASS(peek(vm, 0));
+  tableAddAll(vm, &superclass->methods, &subclass->methods);
+  subclass->initializer = superclass->initializer;
+  WRITE_BARRIER(vm, subclass);
+  pop(vm);
+  return true;
+}
+
+/* Create a closure over the function and capture its upvalues, as described by the descriptors
+that follow the OP_CLOSURE instruction at frame->ip. Leaves the closure on the stack. */
+static void makeClosure(VM *vm, CallFrame *frame, ObjFunction *function) {
+  ObjClosure *closure = newClosure(vm, function);
+  push(vm, OBJ_VAL(closure));
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    uint8_t flags = *frame->ip++;
+    int index = *frame->ip++;
+    if (flags & UPVALUE_LONG) {
+      index = (index << 16) | (frame->ip[0] << 8) | frame->ip[1];
+      frame->ip += 2;
+    }
+    if (flags & UPVALUE_LOCAL) {
+      closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
+    } else {
+      closure->upvalues[i] = frame->closure->upvalues[index];
+    }
+    /* Capturing may have collected and promoted the closure before the store. */
+    WRITE_BARRIER(vm, closure);
+  }
+}
+
+static uint64_t monotonicMicroseconds(void) {
+  struct timespec now;
+#ifdef _WIN32
+  timespec_get(&now, TIME_UTC);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+  return (uint64_t)now.tv_sec * 1000000u + (uint64_t)now.tv_nsec / 1000u;
+}
+
+/* Hand the next batch of steps to run(). A deadline caps the batch, so that the clock gets read. */
+static void refillSteps(VM *vm) {
+  uint64_t steps = vm->sliceStepsLeft;
+  if (vm->sliceMicroseconds > 0 && steps > SLICE_CLOCK_STEPS) {
+    steps = SLICE_CLOCK_STEPS;
+  }
+  vm->stepsLeft = (int64_t)steps;
+  vm->sliceStepsLeft -= steps;
 }
 
-static InterpretResult run(void) {
-  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+/* Without a step limit the slice is as good as endless. */
+static void beginSlice(VM *vm) {
+  vm->sliceStepsLeft = vm->sliceSteps > 0 && vm->sliceSteps < INT64_MAX ? vm->sliceSteps : INT64_MAX;
+  if (vm->sliceMicroseconds > 0) {
+    vm->deadline = monotonicMicroseconds() + vm->sliceMicroseconds;
+  }
+  refillSteps(vm);
+}
+
+/* Called when run() has used up its batch of steps: either the slice is over, or it gets the
+next batch. */
+static NOINLINE bool sliceExpired(VM *vm) {
+  if (vm->sliceStepsLeft == 0 ||
+      (vm->sliceMicroseconds > 0 && monotonicMicroseconds() >= vm->deadline)) {
+    return true;
+  }
+  refillSteps(vm);
+  return false;
+}
+
+void setTimeSlice(VM *vm, uint64_t steps, uint64_t microseconds) {
+  vm->sliceSteps = steps;
+  vm->sliceMicroseconds = microseconds;
+}
+
+static InterpretResult run(VM *vm) {
+  CallFrame *frame = &vm->frames[vm->frameCount - 1];
 /* Macro to read the bytecode pointed by IP */
 #define READ_BYTE() (*frame->ip++)
 /* Yank the next two bytes from the chunk and build a 16-bit unsigned integer out of them. */
 #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+/* Yank the 24-bit operand of a long instruction form. */
+#define READ_LONG() \
+  (frame->ip += 3, (int)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
 /* Macro to read a constant from the next byte after bytecode. */
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG() (frame->closure->function->chunk.constants.values[READ_LONG()])
 
 /* Compiler never emits instructions to non-string const, so we can read a 
 one-byte operand from the bytecode chunk. We treat that as an index into the 
 chunk’s constant table and return the string at that index. */
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 
+/* Count a step against the time slice. Only back-edges and calls take steps, every loop and
+every recursion passes one. frame->ip points at the next instruction, so run() picks up there. */
+#define STEP() \
+  do { \
+    if (--vm->stepsLeft == 0 && sliceExpired(vm)) { \
+      return INTERPRET_YIELD; \
+    } \
+  } while (false)
+
 /* Marco to handle operations that use binary operators */
 #define BINARY_OP(valueType, operator) \
   do { \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-      runtimeError("Operands must be numbers."); \
+    if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+      runtimeError(vm, "Operands must be numbers."); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+    double rhs_operand = AS_NUMBER(pop(vm)); \
+    double lhs_operand = AS_NUMBER(pop(vm)); \
+    push(vm, valueType(lhs_operand operator rhs_operand)); \
+  } while (false)
+
+/* The register forms read their left operand from a slot and their right one from a slot
+(RR) or the constant table (RK), and write the result into the destination slot. */
+#define READ_SLOT() (frame->slots[READ_BYTE()])
+
+#define REGISTER_BINARY_OP(operator, readRhs) \
+  do { \
+    uint8_t destination = READ_BYTE(); \
+    Value lhs_operand = READ_SLOT(); \
+    Value rhs_operand = readRhs; \
+    if (!IS_NUMBER(lhs_operand) || !IS_NUMBER(rhs_operand)) { \
+      runtimeError(vm, "Operands must be numbers."); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+    frame->slots[destination] = NUMBER_VAL(AS_NUMBER(lhs_operand) operator AS_NUMBER(rhs_operand)); \
+  } while (false)
+
+#define REGISTER_ADD(readRhs) \
+  do { \
+    uint8_t destination = READ_BYTE(); \
+    Value lhs_operand = READ_SLOT(); \
+    Value rhs_operand = readRhs; \
+    if (IS_NUMBER(lhs_operand) && IS_NUMBER(rhs_operand)) { \
+      frame->slots[destination] = NUMBER_VAL(AS_NUMBER(lhs_operand) + AS_NUMBER(rhs_operand)); \
+    } else if (IS_STRING(lhs_operand) && IS_STRING(rhs_operand)) { \
+      push(vm, lhs_operand); \
+      push(vm, rhs_operand); \
+      concatenate(vm); \
+      frame->slots[destination] = pop(vm); \
+    } else { \
+      runtimeError(vm, "Operands must be two numbers or two strings."); \
       return INTERPRET_RUNTIME_ERROR; \
     } \
-    double rhs_operand = AS_NUMBER(pop()); \
-    double lhs_operand = AS_NUMBER(pop()); \
-    push(valueType(lhs_operand operator rhs_operand)); \
   } while (false)
 
-  for (;;) {
+/* Quickening: a generic instruction that has just been read rewrites itself into the variant
+specialized for the operand types it sees. A specialized variant whose guard fails turns the
+instruction back into the generic one and executes that instead, which may quicken it again. */
+#define QUICKEN(opcode) (frame->ip[-1] = (opcode))
+
+#define DEOPTIMIZE(opcode) \
+  do { \
+    frame->ip[-1] = (opcode); \
+    frame->ip--; \
+    DISPATCH(); \
+  } while (false)
+
 #ifdef DEBUG_TRACE_EXECUTION
-    // Tracing stack content subroutine
-    printf("          ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
+/* Tracing stack content and the instruction about to be executed. */
+#define TRACE_INSTRUCTION() \
+  do { \
+    printf("          "); \
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) { \
+      printf("[ "); \
+      printValue(*slot); \
+      printf(" ]"); \
+    } \
+    printf("\n"); \
+    /* OFFSET = (INT) CURRENT INSTR ADDR - FIRST INSTR IN CHUNK */ \
+    disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code)); \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
 
-    /* OFFSET = (INT) CURRENT INSTR ADDR - FIRST INSTR IN CHUNK */
-    disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+#ifdef VM_PROFILER
+/* Start timing the instruction about to be dispatched. */
+#define PROFILE_INSTRUCTION() \
+  do { \
+    if (vm->profiler.enabled) { \
+      profileInstruction(&vm->profiler, frame->closure->function, frame->ip, vm->frameCount); \
+    } \
+  } while (false)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
 #endif
 
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-      /* decoding the instruction: opcode -> implementation */
-      case OP_CONSTANT: {
-        Value constant = READ_CONSTANT();
-        push(constant);
-        break;
-      }
-
-      case OP_NIL:        push(NIL_VAL);            break;
-      case OP_TRUE:       push(BOOL_VAL(true));     break;
-      case OP_FALSE:      push(BOOL_VAL(false));    break;
-      case OP_POP:        pop();                    break; // Pop off the stack and discard.
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);     // Access to a given numbered slot relative to the beginning of that frame.
-        break;
-      }
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
-      }
-      case OP_GET_GLOBAL: {
-        /* Pull the constant table index from the instruction’s operand and get the variable name.
-        Then, use that index as a key to look up the variable’s value in the globals hash table. */
-        ObjString *name = READ_STRING();
-        Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-          /* If the key isn’t present in the hash table, it means that global variable has never been defined. */
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        /* Otherwise, we take the value and push it onto the stack. */
-        push(value);
-        break;
-      }
-      case OP_DEFINE_GLOBAL: {
-        /* Get the name of the variable from the constant table. Then take the value from the
-        top of the stack and store it in a hash table with that name as the key. */
-        ObjString *name = READ_STRING();
-        tableSet(&vm.globals, name, peek(0));
-        pop();
-        break;
-      }
-      case OP_SET_GLOBAL: {
-        ObjString *name = READ_STRING();
-        if (tableSet(&vm.globals, name, peek(0))) {
-          /* 
-          The call to tableSet() stores the value in the global variable table even if the variable
-          wasn’t previously defined. That fact is visible in a REPL session, since it keeps running
-          even after the runtime error is reported. So we take care to delete that zombie value from the table.
-          */
-          tableDelete(&vm.globals, name); 
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      }
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
-        break;
-      }
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
-      }
-      case OP_EQUAL: {
-        Value rhs_operand = pop();
-        Value lhs_operand = pop();
-        push(BOOL_VAL(valuesEqual(lhs_operand, rhs_operand)));
-        break;
-      }
-      case OP_GREATER:    BINARY_OP(BOOL_VAL, >); break;
-      case OP_LESS:       BINARY_OP(BOOL_VAL, <); break;
-      case OP_ADD: {
-        /* To support string concatentaion, ADD instruction dynamically 
-        inspects the operands and chooses the right operation. */
-        if (IS_STRING(peek(0)) && (IS_STRING(peek(1)))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && (IS_NUMBER(peek(1)))) {
-          double rhs_operand = AS_NUMBER(pop());
-          double lhs_operand = AS_NUMBER(pop());
-          push(NUMBER_VAL(lhs_operand + rhs_operand));
-        } else {
-          runtimeError("Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      }
-      case OP_SUBTRACT:   BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY:   BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE:     BINARY_OP(NUMBER_VAL, /); break;
-      case OP_NOT:
-        push(BOOL_VAL(isFalsey(pop())));
-        break;
-      case OP_NEGATE:
-        /* Check if the Value on top of the stack is a number. If it’s not, report the runtime error and terminate. */
-        if (!IS_NUMBER(peek(0))) {
-          runtimeError("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
-      case OP_PRINT: {
-        printValue(pop());
-        printf("\n");
-        break;
-      }
-      case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
+#ifdef COMPUTED_GOTO
+  /* Threaded dispatch: every handler jumps straight to the next one through this table,
+  so each opcode gets its own indirect branch. Indexed by OpCode, which stays the only
+  place where opcodes are numbered. */
+  static void *dispatchTable[] = {
+    [OP_CONSTANT] = &&TARGET_OP_CONSTANT,
+    [OP_NIL] = &&TARGET_OP_NIL,
+    [OP_TRUE] = &&TARGET_OP_TRUE,
+    [OP_FALSE] = &&TARGET_OP_FALSE,
+    [OP_POP] = &&TARGET_OP_POP,
+    [OP_GET_LOCAL] = &&TARGET_OP_GET_LOCAL,
+    [OP_SET_LOCAL] = &&TARGET_OP_SET_LOCAL,
+    [OP_GET_GLOBAL] = &&TARGET_OP_GET_GLOBAL,
+    [OP_DEFINE_GLOBAL] = &&TARGET_OP_DEFINE_GLOBAL,
+    [OP_SET_GLOBAL] = &&TARGET_OP_SET_GLOBAL,
+    [OP_GET_UPVALUE] = &&TARGET_OP_GET_UPVALUE,
+    [OP_SET_UPVALUE] = &&TARGET_OP_SET_UPVALUE,
+    [OP_EQUAL] = &&TARGET_OP_EQUAL,
+    [OP_GREATER] = &&TARGET_OP_GREATER,
+    [OP_LESS] = &&TARGET_OP_LESS,
+    [OP_ADD] = &&TARGET_OP_ADD,
+    [OP_SUBTRACT] = &&TARGET_OP_SUBTRACT,
+    [OP_MULTIPLY] = &&TARGET_OP_MULTIPLY,
+    [OP_DIVIDE] = &&TARGET_OP_DIVIDE,
+    [OP_NOT] = &&TARGET_OP_NOT,
+    [OP_NEGATE] = &&TARGET_OP_NEGATE,
+    [OP_PRINT] = &&TARGET_OP_PRINT,
+    [OP_JUMP] = &&TARGET_OP_JUMP,
+    [OP_JUMP_IF_FALSE] = &&TARGET_OP_JUMP_IF_FALSE,
+    [OP_LOOP] = &&TARGET_OP_LOOP,
+    [OP_CALL] = &&TARGET_OP_CALL,
+    [OP_CLOSURE] = &&TARGET_OP_CLOSURE,
+    [OP_CLOSE_UPVALUE] = &&TARGET_OP_CLOSE_UPVALUE,
+    [OP_RETURN] = &&TARGET_OP_RETURN,
+    [OP_NEW_LIST] = &&TARGET_OP_NEW_LIST,
+    [OP_LIST_APPEND] = &&TARGET_OP_LIST_APPEND,
+    [OP_INDEX_GET] = &&TARGET_OP_INDEX_GET,
+    [OP_INDEX_SET] = &&TARGET_OP_INDEX_SET,
+    [OP_CLASS] = &&TARGET_OP_CLASS,
+    [OP_INHERIT] = &&TARGET_OP_INHERIT,
+    [OP_METHOD] = &&TARGET_OP_METHOD,
+    [OP_GET_PROPERTY] = &&TARGET_OP_GET_PROPERTY,
+    [OP_SET_PROPERTY] = &&TARGET_OP_SET_PROPERTY,
+    [OP_INVOKE] = &&TARGET_OP_INVOKE,
+    [OP_GET_SUPER] = &&TARGET_OP_GET_SUPER,
+    [OP_SUPER_INVOKE] = &&TARGET_OP_SUPER_INVOKE,
+    [OP_CONSTANT_LONG] = &&TARGET_OP_CONSTANT_LONG,
+    [OP_GET_LOCAL_LONG] = &&TARGET_OP_GET_LOCAL_LONG,
+    [OP_SET_LOCAL_LONG] = &&TARGET_OP_SET_LOCAL_LONG,
+    [OP_GET_GLOBAL_LONG] = &&TARGET_OP_GET_GLOBAL_LONG,
+    [OP_DEFINE_GLOBAL_LONG] = &&TARGET_OP_DEFINE_GLOBAL_LONG,
+    [OP_SET_GLOBAL_LONG] = &&TARGET_OP_SET_GLOBAL_LONG,
+    [OP_GET_UPVALUE_LONG] = &&TARGET_OP_GET_UPVALUE_LONG,
+    [OP_SET_UPVALUE_LONG] = &&TARGET_OP_SET_UPVALUE_LONG,
+    [OP_CLOSURE_LONG] = &&TARGET_OP_CLOSURE_LONG,
+    [OP_CLASS_LONG] = &&TARGET_OP_CLASS_LONG,
+    [OP_METHOD_LONG] = &&TARGET_OP_METHOD_LONG,
+    [OP_GET_PROPERTY_LONG] = &&TARGET_OP_GET_PROPERTY_LONG,
+    [OP_SET_PROPERTY_LONG] = &&TARGET_OP_SET_PROPERTY_LONG,
+    [OP_INVOKE_LONG] = &&TARGET_OP_INVOKE_LONG,
+    [OP_GET_SUPER_LONG] = &&TARGET_OP_GET_SUPER_LONG,
+    [OP_SUPER_INVOKE_LONG] = &&TARGET_OP_SUPER_INVOKE_LONG,
+    [OP_ADD_LOCAL_CONST] = &&TARGET_OP_ADD_LOCAL_CONST,
+    [OP_INC_LOCAL] = &&TARGET_OP_INC_LOCAL,
+    [OP_LESS_LOCALS_JUMP] = &&TARGET_OP_LESS_LOCALS_JUMP,
+    [OP_MOVE] = &&TARGET_OP_MOVE,
+    [OP_LOADK] = &&TARGET_OP_LOADK,
+    [OP_ADD_RR] = &&TARGET_OP_ADD_RR,
+    [OP_SUBTRACT_RR] = &&TARGET_OP_SUBTRACT_RR,
+    [OP_MULTIPLY_RR] = &&TARGET_OP_MULTIPLY_RR,
+    [OP_DIVIDE_RR] = &&TARGET_OP_DIVIDE_RR,
+    [OP_ADD_RK] = &&TARGET_OP_ADD_RK,
+    [OP_SUBTRACT_RK] = &&TARGET_OP_SUBTRACT_RK,
+    [OP_MULTIPLY_RK] = &&TARGET_OP_MULTIPLY_RK,
+    [OP_DIVIDE_RK] = &&TARGET_OP_DIVIDE_RK,
+    [OP_EQUAL_NUM] = &&TARGET_OP_EQUAL_NUM,
+    [OP_ADD_NUM] = &&TARGET_OP_ADD_NUM,
+    [OP_ADD_STR] = &&TARGET_OP_ADD_STR,
+  };
+
+#define INTERPRET_LOOP    DISPATCH();
+#define CASE(opcode)      TARGET_##opcode
+#define DISPATCH() \
+  do { \
+    TRACE_INSTRUCTION(); \
+    PROFILE_INSTRUCTION(); \
+    goto *dispatchTable[READ_BYTE()]; \
+  } while (false)
+#else
+/* Portable fallback for compilers without labels-as-values (MSVC). */
+#define INTERPRET_LOOP \
+  loop: \
+    TRACE_INSTRUCTION(); \
+    PROFILE_INSTRUCTION(); \
+    switch (READ_BYTE())
+#define CASE(opcode)      case opcode
+#define DISPATCH()        goto loop
+#endif
+
+  INTERPRET_LOOP {
+    /* decoding the instruction: opcode -> implementation */
+    CASE(OP_CONSTANT): {
+      Value constant = READ_CONSTANT();
+      push(vm, constant);
+      DISPATCH();
+    }
+
+    CASE(OP_NIL):      push(vm, NIL_VAL);            DISPATCH();
+    CASE(OP_TRUE):     push(vm, BOOL_VAL(true));     DISPATCH();
+    CASE(OP_FALSE):    push(vm, BOOL_VAL(false));    DISPATCH();
+    CASE(OP_POP):      pop(vm);                  DISPATCH(); // Pop off the stack and discard.
+    CASE(OP_GET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      push(vm, frame->slots[slot]);     // Access to a given numbered slot relative to the beginning of that frame.
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      frame->slots[slot] = peek(vm, 0);
+      DISPATCH();
+    }
+    CASE(OP_GET_GLOBAL): {
+      /* Pull the constant table index from the instruction’s operand, it names the variable.
+      Then, look up the variable’s entry in the globals hash table through the inline cache. */
+      if (!getGlobal(vm, &frame->closure->function->chunk, READ_BYTE())) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_DEFINE_GLOBAL): {
+      /* Get the name of the variable from the constant table. Then take the value from the
+      top of the stack and store it in a hash table with that name as the key. */
+      ObjString *name = READ_STRING();
+      tableSet(vm, &vm->globals, name, peek(vm, 0));
+      pop(vm);
+      DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL): {
+      if (!setGlobal(vm, &frame->closure->function->chunk, READ_BYTE())) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_GET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      push(vm, *frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE(OP_SET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+      *upvalue->location = peek(vm, 0);
+      WRITE_BARRIER(vm, upvalue);
+      DISPATCH();
+    }
+    CASE(OP_EQUAL): {
+      if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+        QUICKEN(OP_EQUAL_NUM);
+      }
+      flattenValue(vm, peek(vm, 0));
+      flattenValue(vm, peek(vm, 1));
+      Value rhs_operand = pop(vm);
+      Value lhs_operand = pop(vm);
+      push(vm, BOOL_VAL(valuesEqual(lhs_operand, rhs_operand)));
+      DISPATCH();
+    }
+    CASE(OP_GREATER):  BINARY_OP(BOOL_VAL, >); DISPATCH();
+    CASE(OP_LESS):     BINARY_OP(BOOL_VAL, <); DISPATCH();
+    CASE(OP_ADD): {
+      /* To support string concatentaion, ADD instruction dynamically 
+      inspects the operands and chooses the right operation. */
+      if (IS_NUMBER(peek(vm, 0)) && (IS_NUMBER(peek(vm, 1)))) {
+        QUICKEN(OP_ADD_NUM);
+        double rhs_operand = AS_NUMBER(pop(vm));
+        double lhs_operand = AS_NUMBER(pop(vm));
+        push(vm, NUMBER_VAL(lhs_operand + rhs_operand));
+      } else if (IS_STRING(peek(vm, 0)) && (IS_STRING(peek(vm, 1)))) {
+        QUICKEN(OP_ADD_STR);
+        concatenate(vm);
+      } else {
+        runtimeError(vm, "Operands must be two numbers or two strings.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+    CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+    CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+    CASE(OP_NOT):
+      push(vm, BOOL_VAL(isFalsey(pop(vm))));
+      DISPATCH();
+    CASE(OP_NEGATE):
+      /* Check if the Value on top of the stack is a number. If it’s not, report the runtime error and terminate. */
+      if (!IS_NUMBER(peek(vm, 0))) {
+        runtimeError(vm, "Operand must be a number.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+      DISPATCH();
+    CASE(OP_PRINT): {
+      flattenValue(vm, peek(vm, 0));
+      printValue(pop(vm));
+      printf("\n");
+      DISPATCH();
+    }
+    CASE(OP_JUMP): {
+      uint16_t offset = READ_SHORT();
+      frame->ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(peek(vm, 0))) {
         frame->ip += offset;
-        break;
       }
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0))) {
-          frame->ip += offset;
-        }
-        break;
+      DISPATCH();
+    }
+    CASE(OP_LOOP): {
+      uint16_t offset = READ_SHORT();
+      frame->ip -= offset;
+      STEP();
+      DISPATCH();
+    }
+    CASE(OP_CONSTANT_LONG):
+      push(vm, READ_CONSTANT_LONG());
+      DISPATCH();
+    CASE(OP_GET_LOCAL_LONG): {
+      int slot = READ_LONG();
+      push(vm, frame->slots[slot]);
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_LONG): {
+      int slot = READ_LONG();
+      frame->slots[slot] = peek(vm, 0);
+      DISPATCH();
+    }
+    CASE(OP_GET_GLOBAL_LONG): {
+      if (!getGlobal(vm, &frame->closure->function->chunk, READ_LONG())) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_DEFINE_GLOBAL_LONG): {
+      ObjString *name = AS_STRING(READ_CONSTANT_LONG());
+      tableSet(vm, &vm->globals, name, peek(vm, 0));
+      pop(vm);
+      DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL_LONG): {
+      if (!setGlobal(vm, &frame->closure->function->chunk, READ_LONG())) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_GET_UPVALUE_LONG): {
+      int slot = READ_LONG();
+      push(vm, *frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE(OP_SET_UPVALUE_LONG): {
+      int slot = READ_LONG();
+      ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+      *upvalue->location = peek(vm, 0);
+      WRITE_BARRIER(vm, upvalue);
+      DISPATCH();
+    }
+    CASE(OP_CLOSURE_LONG): {
+      ObjFunction *function = AS_FUNCTION(READ_CONSTANT_LONG());
+      makeClosure(vm, frame, function);
+      DISPATCH();
+    }
+    CASE(OP_CLASS_LONG):
+      push(vm, OBJ_VAL(newClass(vm, AS_STRING(READ_CONSTANT_LONG()))));
+      DISPATCH();
+    CASE(OP_METHOD_LONG):
+      defineMethod(vm, AS_STRING(READ_CONSTANT_LONG()));
+      DISPATCH();
+    CASE(OP_GET_PROPERTY_LONG): {
+      if (!getProperty(vm, frame->closure->function, READ_LONG())) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_SET_PROPERTY_LONG): {
+      if (!setProperty(vm, frame->closure->function, READ_LONG())) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_INVOKE_LONG): {
+      int index = READ_LONG();
+      int argCount = READ_BYTE();
+      if (!invoke(vm, frame->closure->function, index, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm->frames[vm->frameCount - 1];
+      STEP();
+      DISPATCH();
+    }
+    CASE(OP_GET_SUPER_LONG): {
+      ObjClosure *method = superMethod(vm, AS_STRING(READ_CONSTANT_LONG()));
+      if (method == NULL) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      bindMethod(vm, method);
+      DISPATCH();
+    }
+    CASE(OP_SUPER_INVOKE_LONG): {
+      ObjString *name = AS_STRING(READ_CONSTANT_LONG());
+      int argCount = READ_BYTE();
+      ObjClosure *method = superMethod(vm, name);
+      if (method == NULL || !call(vm, method, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+      frame = &vm->frames[vm->frameCount - 1];
+      STEP();
+      DISPATCH();
+    }
+    CASE(OP_ADD_LOCAL_CONST): {
+      Value lhs_operand = frame->slots[READ_BYTE()];
+      Value rhs_operand = READ_CONSTANT();
+      if (IS_NUMBER(lhs_operand) && IS_NUMBER(rhs_operand)) {
+        push(vm, NUMBER_VAL(AS_NUMBER(lhs_operand) + AS_NUMBER(rhs_operand)));
+      } else if (IS_STRING(lhs_operand) && IS_STRING(rhs_operand)) {
+        push(vm, lhs_operand);
+        push(vm, rhs_operand);
+        concatenate(vm);
+      } else {
+        runtimeError(vm, "Operands must be two numbers or two strings.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_INC_LOCAL): {
+      /* Like OP_ADD_LOCAL_CONST, but the sum goes straight back into the slot. */
+      uint8_t slot = READ_BYTE();
+      Value rhs_operand = READ_CONSTANT();
+      if (IS_NUMBER(frame->slots[slot]) && IS_NUMBER(rhs_operand)) {
+        frame->slots[slot] = NUMBER_VAL(AS_NUMBER(frame->slots[slot]) + AS_NUMBER(rhs_operand));
+      } else if (IS_STRING(frame->slots[slot]) && IS_STRING(rhs_operand)) {
+        push(vm, frame->slots[slot]);
+        push(vm, rhs_operand);
+        concatenate(vm);
+        frame->slots[slot] = pop(vm);
+      } else {
+        runtimeError(vm, "Operands must be two numbers or two strings.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_LESS_LOCALS_JUMP): {
+      /* The comparison result stays on the stack, exactly as OP_JUMP_IF_FALSE leaves it. */
+      Value lhs_operand = frame->slots[READ_BYTE()];
+      Value rhs_operand = frame->slots[READ_BYTE()];
+      uint16_t offset = READ_SHORT();
+      if (!IS_NUMBER(lhs_operand) || !IS_NUMBER(rhs_operand)) {
+        runtimeError(vm, "Operands must be numbers.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      bool isLess = AS_NUMBER(lhs_operand) < AS_NUMBER(rhs_operand);
+      push(vm, BOOL_VAL(isLess));
+      if (!isLess) {
+        frame->ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(OP_MOVE): {
+      uint8_t destination = READ_BYTE();
+      frame->slots[destination] = READ_SLOT();
+      DISPATCH();
+    }
+    CASE(OP_LOADK): {
+      uint8_t destination = READ_BYTE();
+      frame->slots[destination] = READ_CONSTANT();
+      DISPATCH();
+    }
+    CASE(OP_ADD_RR):       REGISTER_ADD(READ_SLOT()); DISPATCH();
+    CASE(OP_SUBTRACT_RR):  REGISTER_BINARY_OP(-, READ_SLOT()); DISPATCH();
+    CASE(OP_MULTIPLY_RR):  REGISTER_BINARY_OP(*, READ_SLOT()); DISPATCH();
+    CASE(OP_DIVIDE_RR):    REGISTER_BINARY_OP(/, READ_SLOT()); DISPATCH();
+    CASE(OP_ADD_RK):       REGISTER_ADD(READ_CONSTANT()); DISPATCH();
+    CASE(OP_SUBTRACT_RK):  REGISTER_BINARY_OP(-, READ_CONSTANT()); DISPATCH();
+    CASE(OP_MULTIPLY_RK):  REGISTER_BINARY_OP(*, READ_CONSTANT()); DISPATCH();
+    CASE(OP_DIVIDE_RK):    REGISTER_BINARY_OP(/, READ_CONSTANT()); DISPATCH();
+    CASE(OP_EQUAL_NUM): {
+      if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
+        DEOPTIMIZE(OP_EQUAL);
       }
-      case OP_CALL: {
-        int argCount = READ_BYTE();
-        if (!callValue(peek(argCount), argCount)) {
+      double rhs_operand = AS_NUMBER(pop(vm));
+      double lhs_operand = AS_NUMBER(pop(vm));
+      push(vm, BOOL_VAL(lhs_operand == rhs_operand));
+      DISPATCH();
+    }
+    CASE(OP_ADD_NUM): {
+      if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
+        DEOPTIMIZE(OP_ADD);
+      }
+      double rhs_operand = AS_NUMBER(pop(vm));
+      double lhs_operand = AS_NUMBER(pop(vm));
+      push(vm, NUMBER_VAL(lhs_operand + rhs_operand));
+      DISPATCH();
+    }
+    CASE(OP_ADD_STR): {
+      if (!IS_STRING(peek(vm, 0)) || !IS_STRING(peek(vm, 1))) {
+        DEOPTIMIZE(OP_ADD);
+      }
+      concatenate(vm);
+      DISPATCH();
+    }
+    CASE(OP_CALL): {
+      int argCount = READ_BYTE();
+      Value callee = peek(vm, argCount);
+      /* A native leaves the frame alone, skip the dispatch on the callee type and the reload. */
+      if (IS_NATIVE(callee)) {
+        if (!callNative(vm, AS_NATIVE(callee), argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
-      }
-      case OP_CLOSURE: {
-        ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure *closure = newClosure(function);
-        push(OBJ_VAL(closure));
-        for (int i = 0; i < closure->upvalueCount; i++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (isLocal) {
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
-          }
-        }
-        break;
-      }
-      case OP_CLOSE_UPVALUE:
-        closeUpvalues(vm.stackTop - 1);
-        pop();
-        break;
-      case OP_RETURN: {
-        Value result = pop();
-        closeUpvalues(frame->slots);
-        vm.frameCount--;
-        if (vm.frameCount == 0) {
-          pop();
-          return INTERPRET_OK;
-        }
+        DISPATCH();
+      }
+      if (!callValue(vm, callee, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm->frames[vm->frameCount - 1];
+      STEP();
+      DISPATCH();
+    }
+    CASE(OP_CLOSURE): {
+      ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+      makeClosure(vm, frame, function);
+      DISPATCH();
+    }
+    CASE(OP_CLOSE_UPVALUE):
+      closeUpvalues(vm, vm->stackTop - 1);
+      pop(vm);
+      DISPATCH();
+    CASE(OP_RETURN): {
+      Value result = pop(vm);
+      closeUpvalues(vm, frame->slots);
+      vm->frameCount--;
+      if (vm->frameCount == 0) {
+        /* Hand the result to callFunction(), in place of the closure and its arguments. */
+        vm->stackTop = frame->slots;
+        push(vm, result);
+        return INTERPRET_OK;
+      }
 
-        vm.stackTop = frame->slots;
-        push(result);
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+      vm->stackTop = frame->slots;
+      push(vm, result);
+      frame = &vm->frames[vm->frameCount - 1];
+      DISPATCH();
+    }
+    CASE(OP_NEW_LIST):
+      push(vm, OBJ_VAL(newList(vm)));
+      DISPATCH();
+    CASE(OP_LIST_APPEND): {
+      /* The element stays on the stack until it is in the list, appending may collect. */
+      appendToList(vm, AS_LIST(peek(vm, 1)), peek(vm, 0));
+      pop(vm);
+      DISPATCH();
+    }
+    CASE(OP_INDEX_GET): {
+      int index;
+      if (!checkIndex(vm, peek(vm, 1), peek(vm, 0), &index)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      Value element = AS_LIST(peek(vm, 1))->items.values[index];
+      vm->stackTop -= 2;
+      push(vm, element);
+      DISPATCH();
+    }
+    CASE(OP_INDEX_SET): {
+      int index;
+      if (!checkIndex(vm, peek(vm, 2), peek(vm, 1), &index)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ObjList *list = AS_LIST(peek(vm, 2));
+      Value element = peek(vm, 0);
+      list->items.values[index] = element;
+      WRITE_BARRIER(vm, list);
+      /* Assignment is an expression, leave the assigned value. */
+      vm->stackTop -= 3;
+      push(vm, element);
+      DISPATCH();
+    }
+    CASE(OP_CLASS):
+      push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
+      DISPATCH();
+    CASE(OP_INHERIT): {
+      if (!inherit(vm)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_METHOD):
+      defineMethod(vm, READ_STRING());
+      DISPATCH();
+    CASE(OP_GET_PROPERTY): {
+      if (!getProperty(vm, frame->closure->function, READ_BYTE())) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_SET_PROPERTY): {
+      if (!setProperty(vm, frame->closure->function, READ_BYTE())) {
+        return INTERPRET_RUNTIME_ERROR;
       }
+      DISPATCH();
+    }
+    CASE(OP_INVOKE): {
+      int index = READ_BYTE();
+      int argCount = READ_BYTE();
+      if (!invoke(vm, frame->closure->function, index, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm->frames[vm->frameCount - 1];
+      STEP();
+      DISPATCH();
+    }
+    CASE(OP_GET_SUPER): {
+      ObjClosure *method = superMethod(vm, READ_STRING());
+      if (method == NULL) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      bindMethod(vm, method);
+      DISPATCH();
+    }
+    CASE(OP_SUPER_INVOKE): {
+      ObjString *name = READ_STRING();
+      int argCount = READ_BYTE();
+      ObjClosure *method = superMethod(vm, name);
+      if (method == NULL || !call(vm, method, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm->frames[vm->frameCount - 1];
+      STEP();
+      DISPATCH();
     }
   }
+  /* Only reachable from the switch fallback when the byte is not a known opcode. */
+  return INTERPRET_RUNTIME_ERROR;
 
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_STRING
+#undef READ_LONG
+#undef READ_CONSTANT_LONG
 #undef BINARY_OP
+#undef READ_SLOT
+#undef STEP
+#undef REGISTER_BINARY_OP
+#undef REGISTER_ADD
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
-InterpretResult interpret(const char *source) {
-  ObjFunction *function = compile(source);
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+InterpretResult interpret(VM *vm, const char *source) {
+  ObjFunction *function = compile(vm, source, strlen(source));
   if (function == NULL) {
     return INTERPRET_COMPILE_ERROR;
   }
-  push(OBJ_VAL(function));
-  ObjClosure *closure = newClosure(function);
-  pop();
-  push(OBJ_VAL(closure));
-  call(closure, 0);
+  return interpretFunction(vm, function);
+}
+
+InterpretResult interpretFunction(VM *vm, ObjFunction *function) {
+  push(vm, OBJ_VAL(function));
+  ObjClosure *closure = newClosure(vm, function);
+  pop(vm);
+  push(vm, OBJ_VAL(closure));
+
+  InterpretResult result = callFunction(vm, 0);
+  if (result == INTERPRET_OK) {
+    pop(vm);
+  }
+  return result;
+}
+
+InterpretResult callFunction(VM *vm, int argCount) {
+  if (!call(vm, AS_CLOSURE(peek(vm, argCount)), argCount)) {
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  return resumeScript(vm);
+}
+
+InterpretResult resumeScript(VM *vm) {
+  if (vm->frameCount == 0) {
+    fprintf(stderr, "There is no script to resume.\n");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+
+  beginSlice(vm);
+  InterpretResult result = run(vm);
+#ifdef VM_PROFILER
+  profileStop(&vm->profiler);
+#endif
+  return result;
+}
 
-  return run();
+void abortScript(VM *vm) {
+  resetStack(vm);
 }
@@ -8,44 +8,155 @@
 #include "chunk.h"
 #include "object.h"
 #include "table.h"
+#include "memory.h"
+#include "profiler.h"
 
-#define FRAMES_MAX 64
+/* The value stack and the frame array start small and grow on demand, up to these hard limits
+on the depth of the call stack. Override them with -DFRAMES_MAX=n. */
+#ifndef FRAMES_MAX
+  #define FRAMES_MAX 4096
+#endif
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL 256
+
+/* Steps between two readings of the clock when a time slice has a deadline. */
+#define SLICE_CLOCK_STEPS 1024
+
 typedef struct {
   ObjClosure  *closure;
   uint8_t     *ip;
   Value       *slots;           // The first slot that a function can use.
 } CallFrame;
 
-/* A VM registers. */
-typedef struct {
-  CallFrame   frames[FRAMES_MAX];
+/* A closure handed out to a host by the embedding API in clox.h. The VM keeps every one of them
+alive until the host releases it. */
+typedef struct CloxFunction {
+  ObjClosure          *closure;
+  struct CloxFunction *previous;
+  struct CloxFunction *next;
+} CloxFunction;
+
+/* A VM registers. Each instance owns its own heap, so any number of them can coexist. */
+struct VM {
+  CallFrame   *frames;
   int         frameCount;
-  Value       stack[STACK_MAX];
+  int         frameCapacity;
+  Value       *stack;             // Moves when it grows, see growStack().
   Value       *stackTop;          // Just past the element containing the top value.
+  Value       *stackEnd;          // Just past the last allocated slot.
   Table       globals;
   Table       strings;
-  ObjUpvalue  *openUpvalues;
-  Obj         *objects;
-} VM;
+  ObjUpvalue  **openUpvalues;     // Parallel to the stack: the open upvalue of each slot, or NULL.
+  int         openUpvalueCount;
+  Obj         *objects;           // Old generation: objects that survived a collection.
+  Obj         *nursery;           // Young generation: objects allocated since the last collection.
+  size_t      bytesAllocated;     // Total size of the managed heap.
+  size_t      nextGC;             // Heap size that triggers the next full collection.
+  size_t      nurseryBytes;       // Bytes allocated since the last collection.
+  size_t      peakBytesAllocated; // Largest the managed heap has been.
+  size_t      totalBytesAllocated; // Every byte ever allocated, freed ones included.
+  uint64_t    collections;        // Nursery and full collections run so far.
+  uint64_t    fullCollections;
+  int         objectCounts[OBJ_TYPE_COUNT]; // Live (or not yet swept) objects of each type.
+  int         grayCount;
+  int         grayCapacity;
+  Obj         **grayStack;        // Marked objects whose references are not traced yet.
+  int         rememberedCount;
+  int         rememberedCapacity;
+  Obj         **remembered;       // Old objects written to since the last collection.
+  CloxFunction *hostFunctions;    // Held by the host, see clox.h.
+  uint64_t    sliceSteps;         // Limits of each time slice, 0 for none. See setTimeSlice().
+  uint64_t    sliceMicroseconds;
+  int64_t     stepsLeft;          // Until the budget is checked again, counted down by run().
+  uint64_t    sliceStepsLeft;     // Steps of the slice not handed to stepsLeft yet.
+  uint64_t    deadline;           // End of the slice, in microseconds of the monotonic clock.
+  Allocator   allocator;          // Pools backing every reallocate() call.
+#ifdef VM_PROFILER
+  Profiler    profiler;           // Enabled by --profile, reported by freeVM().
+#endif
+};
+
+/* Fill level of a hash table. */
+typedef struct {
+  int         live;               // Buckets holding a key.
+  int         used;               // Live and deleted buckets, checked against the load factor.
+  int         capacity;
+} TableStats;
+
+/* A snapshot of the memory use of a VM, see getHeapStats(). */
+typedef struct {
+  size_t      bytesAllocated;
+  size_t      peakBytesAllocated;
+  size_t      totalBytesAllocated;
+  size_t      nextGC;
+  uint64_t    collections;
+  uint64_t    fullCollections;
+  int         objectCounts[OBJ_TYPE_COUNT];
+  TableStats  globals;
+  TableStats  strings;            // The intern table.
+} HeapStats;
 
 typedef enum {
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
-  INTERPRET_RUNTIME_ERROR
+  INTERPRET_RUNTIME_ERROR,
+  INTERPRET_YIELD,                // The time slice ran out, resumeScript() continues the script.
 } InterpretResult;
 
-extern VM vm;
+void initVM(VM *vm);
 
-void initVM(void);
+void freeVM(VM *vm);
+
+InterpretResult interpret(VM *vm, const char *source);
+
+/* Run an already compiled top-level script function, e.g. one loaded from a bytecode cache. */
+InterpretResult interpretFunction(VM *vm, ObjFunction *function);
+
+/* Call the closure that sits below argCount arguments on top of the stack and run it until it
+returns, which leaves its return value in their place. The VM loop is not reentrant: this must
+not be called while a script is running, from inside a native for one. */
+InterpretResult callFunction(VM *vm, int argCount);
+
+/* Cut every run of a script into time slices of at most the given number of steps (loop
+iterations and calls) or microseconds, whichever runs out first. Zero lifts either limit. The
+steps are counted at back-edges and calls only, so a slice may overrun by one straight-line
+stretch of code; the clock is read every SLICE_CLOCK_STEPS steps. */
+void setTimeSlice(VM *vm, uint64_t steps, uint64_t microseconds);
+
+/* Continue the script that returned INTERPRET_YIELD with a fresh slice. Once it finishes, its
+return value is left on the stack as callFunction() does. A suspended VM may be resumed from
+another thread, as long as one thread at a time uses it. */
+InterpretResult resumeScript(VM *vm);
+
+/* Drop a suspended script, closing its upvalues, so that the VM can run something else. */
+void abortScript(VM *vm);
+
+/* Sample the memory use of the VM. Cheap enough to call between scripts or from a monitoring
+thread that has stopped the VM, the table statistics scan both tables. */
+void getHeapStats(VM *vm, HeapStats *stats);
+
+/* The name objectCount() gives the object type, indexed by ObjType. */
+const char* objectTypeName(ObjType type);
+
+/* One entry of a table of natives for defineNatives(), which ends with a NULL name. */
+typedef struct {
+  const char  *name;
+  NativeFn    function;
+  int         arity;              // NATIVE_VARIADIC if the native checks its arguments itself.
+} NativeDef;
 
-void freeVM(void);
+/* Define each native of the table as a global of the given name, replacing any global that is
+already there. The table is only read during the call. */
+void defineNatives(VM *vm, const NativeDef *natives);
 
-InterpretResult interpret(const char *source);
+/* Report a runtime error from inside a native, with the stack trace of the calling script. The
+native must return false right after, the VM stack is gone by then. */
+void nativeError(VM *vm, const char *format, ...);
 
-void push(Value value);
+void push(VM *vm, Value value);
 
-Value pop(void);
+Value pop(VM *vm);
 
 #endif